@@ -172,11 +172,14 @@ int vhost_ioctl(UnSock* client, VhostUserRequest request, ...)
 
     switch (request) {
     case VHOST_USER_GET_FEATURES:
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+    case VHOST_USER_GET_QUEUE_NUM:
     case VHOST_USER_GET_VRING_BASE:
         need_reply = 1;
         break;
 
     case VHOST_USER_SET_FEATURES:
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
     case VHOST_USER_SET_LOG_BASE:
         msg.u64 = *((uint64_t*) arg);
         msg.size = MEMBER_SIZE(VhostUserMsg,u64);
@@ -202,6 +205,7 @@ int vhost_ioctl(UnSock* client, VhostUserRequest request, ...)
 
     case VHOST_USER_SET_VRING_NUM:
     case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ENABLE:
         memcpy(&msg.state, arg, MEMBER_SIZE(VhostUserMsg,state));
         msg.size = MEMBER_SIZE(VhostUserMsg,state);
         break;
@@ -249,6 +253,8 @@ int vhost_ioctl(UnSock* client, VhostUserRequest request, ...)
 
         switch (request) {
         case VHOST_USER_GET_FEATURES:
+        case VHOST_USER_GET_PROTOCOL_FEATURES:
+        case VHOST_USER_GET_QUEUE_NUM:
             *((uint64_t*) arg) = msg.u64;
             break;
         case VHOST_USER_GET_VRING_BASE:
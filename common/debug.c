@@ -42,6 +42,14 @@ const char* cmd_from_vhost_request(VhostUserRequest request)
         return "VHOST_USER_SET_VRING_CALL";
     case VHOST_USER_SET_VRING_ERR:
         return "VHOST_USER_SET_VRING_ERR";
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        return "VHOST_USER_GET_PROTOCOL_FEATURES";
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        return "VHOST_USER_SET_PROTOCOL_FEATURES";
+    case VHOST_USER_GET_QUEUE_NUM:
+        return "VHOST_USER_GET_QUEUE_NUM";
+    case VHOST_USER_SET_VRING_ENABLE:
+        return "VHOST_USER_SET_VRING_ENABLE";
     case VHOST_USER_MAX:
         return "VHOST_USER_MAX";
     }
@@ -107,6 +115,14 @@ void dump_vhostmsg(const VhostUserMsg* msg)
     case VHOST_USER_SET_VRING_ERR:
         fprintf(stdout, "u64: 0x%"PRIx64"\n", msg->u64);
         break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+    case VHOST_USER_GET_QUEUE_NUM:
+        fprintf(stdout, "u64: 0x%"PRIx64"\n", msg->u64);
+        break;
+    case VHOST_USER_SET_VRING_ENABLE:
+        fprintf(stdout, "state: %d %d\n", msg->state.index, msg->state.num);
+        break;
     case VHOST_USER_NONE:
     case VHOST_USER_MAX:
         break;
@@ -128,12 +144,13 @@ void dump_buffer(uint8_t* p, size_t len)
 }
 
 // dump a vring struct
-void dump_vring(struct vring_desc* desc, struct vring_avail* avail,struct vring_used* used)
+void dump_vring(struct vring_desc* desc, struct vring_avail* avail,struct vring_used* used,
+        unsigned int num)
 {
     int idx;
 
     fprintf(stdout,"desc:\n");
-    for(idx=0;idx<VHOST_VRING_SIZE;idx++){
+    for(idx=0;idx<num;idx++){
         fprintf(stdout, "%d: 0x%"PRIx64" %d 0x%x %d\n",
                 idx,
                 desc[idx].addr, desc[idx].len,
@@ -141,7 +158,7 @@ void dump_vring(struct vring_desc* desc, struct vring_avail* avail,struct vring_
     }
 
     fprintf(stdout,"avail:\n");
-    for(idx=0;idx<VHOST_VRING_SIZE;idx++){
+    for(idx=0;idx<num;idx++){
        int desc_idx = avail->ring[idx];
        fprintf(stdout, "%d: %d\n",idx, desc_idx);
 
@@ -153,5 +170,5 @@ void dump_vring(struct vring_desc* desc, struct vring_avail* avail,struct vring_
 void dump_vhost_vring(struct vhost_vring* vring)
 {
     fprintf(stdout, "kickfd: 0x%x, callfd: 0x%x\n", vring->kickfd, vring->callfd);
-    dump_vring(vring->desc, &vring->avail, &vring->used);
+    dump_vring(vring->desc, vhost_vring_avail(vring), vhost_vring_used(vring), vring->num);
 }
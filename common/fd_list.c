@@ -8,160 +8,473 @@
  *
  */
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "fd_list.h"
 
-static int reset_fd_node(struct fd_node* fd_node)
+// user_data of the io_uring requests that don't belong to a fd_node
+#define FD_LIST_URING_NOTIFY    0
+#define FD_LIST_URING_CANCEL    1
+
+/* init a fd_list struct, reset all fds and handler */
+int init_fd_list(FdList* fd_list, uint32_t ms)
 {
-    fd_node->fd = -1;
-    fd_node->context = NULL;
-    fd_node->handler = NULL;
+    fd_list->ms = ms;
+    fd_list->size = FD_LIST_SIZE;
+    fd_list->read_fds = (struct fd_node**) calloc(FD_LIST_SIZE, sizeof(struct fd_node*));
+    fd_list->write_fds = (struct fd_node**) calloc(FD_LIST_SIZE, sizeof(struct fd_node*));
+    fd_list->dead = NULL;
+    fd_list->uring = NULL;
+    fd_list->epfd = -1;
+
+#ifdef FD_LIST_URING
+    fd_list->uring = (Uring*) malloc(sizeof(Uring));
+    if (fd_list->uring
+            && init_uring(fd_list->uring, FD_LIST_URING_ENTRIES, FD_LIST_URING_SQPOLL) != 0) {
+        perror("io_uring, using epoll");
+        free(fd_list->uring);
+        fd_list->uring = NULL;
+    }
+#endif
+    if (!fd_list->uring) {
+        fd_list->epfd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    if (!fd_list->read_fds || !fd_list->write_fds || (!fd_list->uring && fd_list->epfd == -1)) {
+        perror("init_fd_list");
+        end_fd_list(fd_list);
+        return -1;
+    }
 
     return 0;
 }
 
-/* init a fd_list struct, reset all fds and handler */
-int init_fd_list(FdList* fd_list, uint32_t ms)
+// 删除所有fd，关闭epoll fd或io_uring，注册的fd本身由各自的owner关闭
+void end_fd_list(FdList* fd_list)
 {
-    int idx;
+    uint32_t idx;
+
+    // closing the ring cancels what is in flight, no request points to a node after this
+    if (fd_list->uring) {
+        end_uring(fd_list->uring);
+        free(fd_list->uring);
+        fd_list->uring = NULL;
+    }
+    while (fd_list->dead) {
+        struct fd_node* next = fd_list->dead->next;
+
+        free(fd_list->dead);
+        fd_list->dead = next;
+    }
+
+    for (idx = 0; idx < fd_list->size; idx++) {
+        if (fd_list->read_fds) {
+            free(fd_list->read_fds[idx]);
+        }
+        if (fd_list->write_fds) {
+            free(fd_list->write_fds[idx]);
+        }
+    }
+    free(fd_list->read_fds);
+    free(fd_list->write_fds);
+    fd_list->read_fds = NULL;
+    fd_list->write_fds = NULL;
+    fd_list->size = 0;
+
+    if (fd_list->epfd >= 0) {
+        close(fd_list->epfd);
+    }
+    fd_list->epfd = -1;
+}
+
+static struct fd_node** get_fds(FdList* fd_list, FdType type)
+{
+    return (type == FD_WRITE) ? fd_list->write_fds : fd_list->read_fds;
+}
+
+static struct fd_node* find_fd_node(FdList* fd_list, FdType type, int fd)
+{
+    if (fd < 0 || fd >= fd_list->size) {
+        return NULL;
+    }
+
+    return get_fds(fd_list, type)[fd];
+}
+
+// 下标表按2倍扩大到能放下fd
+static int grow_fd_list(FdList* fd_list, int fd)
+{
+    uint32_t size = fd_list->size;
+    struct fd_node** fds;
+
+    while (size <= fd) {
+        size *= 2;
+    }
+
+    fds = (struct fd_node**) realloc(fd_list->read_fds, size * sizeof(struct fd_node*));
+    if (!fds) {
+        return -1;
+    }
+    memset(fds + fd_list->size, 0, (size - fd_list->size) * sizeof(struct fd_node*));
+    fd_list->read_fds = fds;
 
-    for (idx = 0; idx < FD_LIST_SIZE; idx++) {
-        reset_fd_node(&(fd_list->read_fds[idx]));
-        reset_fd_node(&(fd_list->write_fds[idx]));
+    fds = (struct fd_node**) realloc(fd_list->write_fds, size * sizeof(struct fd_node*));
+    if (!fds) {
+        return -1;
     }
+    memset(fds + fd_list->size, 0, (size - fd_list->size) * sizeof(struct fd_node*));
+    fd_list->write_fds = fds;
 
-    fd_list-> ms = ms;
+    fd_list->size = size;
 
     return 0;
 }
 
-static struct fd_node* find_fd_node(struct fd_node* fds, int fd)
+/* 按fd现有的read/write node更新epoll里的注册
+ * fd关闭时epoll已经自动删除，同一个fd号再加进来时重新ADD
+ */
+static int update_epoll(FdList* fd_list, int fd)
 {
-    int idx;
+    struct epoll_event ev = { .data.fd = fd };
+
+    ev.events = (find_fd_node(fd_list, FD_READ, fd) ? EPOLLIN : 0)
+            | (find_fd_node(fd_list, FD_WRITE, fd) ? EPOLLOUT : 0);
 
-    for (idx = 0; idx < FD_LIST_SIZE; idx++) {
-        if (fds[idx].fd == fd) {
-            return &(fds[idx]);
+    if (!ev.events) {
+        // the fd may be closed already, which dropped it from the epoll set
+        if (epoll_ctl(fd_list->epfd, EPOLL_CTL_DEL, fd, NULL) == -1
+                && errno != EBADF && errno != ENOENT) {
+            perror("epoll_ctl del");
+            return -1;
         }
+        return 0;
     }
 
-    return NULL;
+    if (epoll_ctl(fd_list->epfd, EPOLL_CTL_ADD, fd, &ev) == -1
+            && (errno != EEXIST || epoll_ctl(fd_list->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
 }
 
-/* find an unsed fd_node and add specified fd/context/handler to the list */
+// SQ满时先提交一次
+static struct io_uring_sqe* get_sqe(FdList* fd_list)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(fd_list->uring);
+
+    if (!sqe && uring_submit(fd_list->uring, 0, 0) >= 0) {
+        sqe = uring_get_sqe(fd_list->uring);
+    }
+
+    return sqe;
+}
+
+/* io_uring下每个node有一个请求在等：FD_EVENT直接读eventfd的计数，
+ * 其它fd是一次性的poll，handler返回后再重新提交
+ */
+static int arm_fd_node(FdList* fd_list, struct fd_node* node)
+{
+    struct io_uring_sqe* sqe = get_sqe(fd_list);
+
+    if (!sqe) {
+        fprintf(stderr, "Fd (%d): io_uring is full\n", node->fd);
+        return -1;
+    }
+
+    sqe->fd = node->fd;
+    if (node->type == FD_EVENT) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uintptr_t) &node->value;
+        sqe->len = sizeof(node->value);
+        sqe->off = (uint64_t) -1;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = (node->type == FD_WRITE) ? POLLOUT : POLLIN;
+    }
+    sqe->user_data = (uintptr_t) node;
+    node->armed = 1;
+
+    return 0;
+}
+
+/* add fd/context/handler to the list, an fd already in it gets the new handler */
 int add_fd_list(FdList* fd_list, FdType type, int fd, void* context, fd_handler_t handler)
 {
-    struct fd_node* fds = (type == FD_READ) ? fd_list->read_fds : fd_list->write_fds;
-    struct fd_node* fd_node = find_fd_node(fds, -1);
+    struct fd_node* fd_node;
 
-    if (!fd_node) {
+    if (fd < 0 || (fd >= fd_list->size && grow_fd_list(fd_list, fd) != 0)) {
         perror("No space in fd list");
         return -1;
     }
 
+    // an eventfd and a plain read fd wait for different requests
+    fd_node = get_fds(fd_list, type)[fd];
+    if (fd_node && fd_node->type != type) {
+        del_fd_list(fd_list, fd_node->type, fd);
+        fd_node = NULL;
+    }
+    if (!fd_node) {
+        fd_node = (struct fd_node*) calloc(1, sizeof(struct fd_node));
+        if (!fd_node) {
+            perror("No space in fd list");
+            return -1;
+        }
+        get_fds(fd_list, type)[fd] = fd_node;
+    }
+
     fd_node->fd = fd;
     fd_node->context = context;
     fd_node->handler = handler;
+    fd_node->type = type;
+
+    if (fd_list->uring ? (!fd_node->armed && arm_fd_node(fd_list, fd_node) != 0)
+            : update_epoll(fd_list, fd) != 0) {
+        get_fds(fd_list, type)[fd] = NULL;
+        free(fd_node);
+        return -1;
+    }
 
     return 0;
 }
 
 int del_fd_list(FdList* fd_list, FdType type, int fd)
 {
-    struct fd_node* fds = (type == FD_READ) ? fd_list->read_fds : fd_list->write_fds;
-    struct fd_node* fd_node = find_fd_node(fds, fd);
+    struct fd_node* fd_node = find_fd_node(fd_list, type, fd);
+    struct io_uring_sqe* sqe;
 
     if (!fd_node) {
         fprintf(stderr, "Fd (%d) not found fd list\n", fd);
         return -1;
     }
 
-    reset_fd_node(fd_node);
+    get_fds(fd_list, type)[fd] = NULL;
+
+    if (!fd_list->uring) {
+        free(fd_node);
+        return update_epoll(fd_list, fd);
+    }
+
+    // the request in flight still points to the node, it is freed once that completes
+    if (fd_node->armed) {
+        sqe = get_sqe(fd_list);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uintptr_t) fd_node;
+            sqe->user_data = FD_LIST_URING_CANCEL;
+        }
+        fd_node->fd = -1;
+        fd_node->next = fd_list->dead;
+        fd_list->dead = fd_node;
+        return 0;
+    }
+
+    free(fd_node);
 
     return 0;
 }
 
-/* 生成一个文件描述符集合，宏由C库函数提供，
-   集合包括目前有效的文件描述符（非-1），
-   fdmax是现有集合里文件描述符的最大值。
-   返回值：集合内fd最大值
-*/
-static int get_fd_set(FdList* fd_list, FdType type, fd_set* fdset)
+/* eventfd加1。io_uring时排进SQ，和下次traverse_fd_list一起提交，
+ * 没有io_uring时返回-1，由调用者自己write
+ */
+int notify_fd_list(FdList* fd_list, int fd)
 {
-    int idx;
-    struct fd_node* fds = (type == FD_READ) ? fd_list->read_fds : fd_list->write_fds;
+    static const uint64_t one = 1;
+    struct io_uring_sqe* sqe;
 
-    FD_ZERO(fdset);
+    if (!fd_list->uring || !(sqe = get_sqe(fd_list))) {
+        return -1;
+    }
 
-    int fdmax = -1;
-    for (idx = 0; idx < FD_LIST_SIZE; idx++) {
-        int fd = fds[idx].fd;
-        if (fd != -1) {
-            FD_SET(fd, fdset);
-            fdmax = MAX(fd, fdmax);
-        }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) &one;
+    sqe->len = sizeof(one);
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = FD_LIST_URING_NOTIFY;
+
+    // the SQ thread picks it up right away, without a syscall while it is awake
+    if (fd_list->uring->flags & IORING_SETUP_SQPOLL) {
+        uring_submit(fd_list->uring, 0, 0);
     }
 
-    return fdmax;
+    return 0;
 }
 
-/* 针对fd集合，调用回调函数，handler为下列一种：
+/* FD_EVENT读计数的结果，r是读到的字节数或-errno，读到0表示fd已关闭
+ * 没有计数可读时什么都不做，关闭或出错的fd从list里删掉
+ */
+static int check_event(FdList* fd_list, struct fd_node* node, ssize_t r)
+{
+    if (r == sizeof(node->value)) {
+        return 0;
+    }
+    if (r == -EAGAIN || r == -EINTR) {
+        return -1;
+    }
+
+    if (r == 0) {
+        fprintf(stdout, "Fd (%d) closed\n", node->fd);
+    } else {
+        fprintf(stderr, "Fd (%d): read %s\n", node->fd, r < 0 ? strerror(-r) : "short");
+    }
+    del_fd_list(fd_list, node->type, node->fd);
+
+    return -1;
+}
+
+/* 调用fd的回调函数，handler为下列一种：
    _kick_client
    _kick_server
    accept_sock_server
    receive_sock_server
+   handler可能删除任意fd，所以每次都按fd重新查找node
 */
-static int process_fd_set(FdList* fd_list, FdType type, fd_set* fdset)
+static int process_fd(FdList* fd_list, FdType type, int fd)
 {
-    int idx;
-    int num_of_fds = 0;     // introduced fix
-    struct fd_node* fds = (type == FD_READ) ? fd_list->read_fds : fd_list->write_fds;
-
-    for (idx = 0; idx < FD_LIST_SIZE; idx++) {
-        struct fd_node* node = &(fds[idx]);
-        if (FD_ISSET(node->fd,fdset)) {
-            num_of_fds++;
-            if (node->handler) {
-                node->handler(node);
-            }
+    struct fd_node* node = find_fd_node(fd_list, type, fd);
+    ssize_t r;
+
+    if (!node) {
+        return 0;
+    }
+    if (node->type == FD_EVENT) {
+        r = read(fd, &node->value, sizeof(node->value));
+        if (check_event(fd_list, node, r < 0 ? -errno : r) != 0) {
+            return 0;
         }
     }
+    if (node->handler) {
+        node->handler(node);
+    }
 
-    // return 0;
-    return num_of_fds;
+    return 1;
 }
 
-int traverse_fd_list(FdList* fd_list)
+static int traverse_epoll(FdList* fd_list)
 {
-    fd_set read_fdset, write_fdset;
-    struct timeval tv = { .tv_sec = fd_list->ms/1000,
-                          .tv_usec = (fd_list->ms%1000)*1000 };
+    struct epoll_event events[FD_LIST_EVENTS];
+    int idx;
     int r;
 
-    int rfd_max = get_fd_set(fd_list, FD_READ, &read_fdset);
-    int wfd_max = get_fd_set(fd_list, FD_WRITE, &write_fdset);
-    // man: nfds should be set to the highest-numbered file descriptor in any of the three sets, plus 1.
-    int nfds = MAX(rfd_max, wfd_max) + 1;
-    
-    r = select(nfds, &read_fdset, &write_fdset, 0, &tv);
+    r = epoll_wait(fd_list->epfd, events, FD_LIST_EVENTS, fd_list->ms);
 
     if (r == -1) {
-        perror("select");
-    } else if (r == 0) {
-        // no ready fds, timeout
+        if (errno != EINTR) {
+            perror("epoll_wait");
+        }
     } else {
-        // non-zero, something available
-        // check accept_sock_server (listen) or receive_sock_server (connect) for further
-        // processing logic
-        int rr = process_fd_set(fd_list, FD_READ, &read_fdset);
-        int wr = process_fd_set(fd_list, FD_WRITE, &write_fdset);
-        if (r != (rr + wr)) {
-            // something wrong
+        // a hang-up or an error goes to the read handler, whose read sees it
+        for (idx = 0; idx < r; idx++) {
+            int fd = events[idx].data.fd;
+
+            if (events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                process_fd(fd_list, FD_READ, fd);
+            }
+            if (events[idx].events & (EPOLLOUT | EPOLLERR)) {
+                process_fd(fd_list, FD_WRITE, fd);
+            }
         }
     }
 
     return r;
 }
+
+/* 一个node的请求完成了，res是poll到的事件、读到的字节数或-errno
+ * 被打断的请求重新提交。出错的请求不会再完成，fd不能一直留在list里没有事件：
+ * eventfd直接删掉，其它fd先交给handler，它的read/accept会看到错误，之后还在就删掉
+ */
+static int process_cqe(FdList* fd_list, struct fd_node* node, int res)
+{
+    FdType type = node->type;
+    int fd = node->fd;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        arm_fd_node(fd_list, node);
+        return 0;
+    }
+
+    if (type == FD_EVENT && check_event(fd_list, node, res) != 0) {
+        return 0;
+    }
+    if (res < 0) {
+        fprintf(stderr, "Fd (%d): poll %s\n", fd, strerror(-res));
+    }
+
+    if (node->handler) {
+        node->handler(node);
+    }
+
+    // the handler may have deleted the node, or replaced it
+    node = find_fd_node(fd_list, type, fd);
+    if (node && res < 0) {
+        del_fd_list(fd_list, type, fd);
+    } else if (node && !node->armed) {
+        arm_fd_node(fd_list, node);
+    }
+
+    return 1;
+}
+
+/* 一次系统调用提交排队的请求(重新poll的fd，eventfd的读写)并等待完成
+ * 已经有完成的请求，或ms为0时不等，SQPOLL下这时通常没有系统调用
+ */
+static int traverse_uring(FdList* fd_list)
+{
+    Uring* uring = fd_list->uring;
+    struct io_uring_cqe* cqe;
+    int count = 0;
+    int n = 0;
+
+    if (uring_submit(uring, (fd_list->ms && !uring_peek_cqe(uring)) ? 1 : 0, fd_list->ms) < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    while (count++ < FD_LIST_EVENTS && (cqe = uring_peek_cqe(uring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        struct fd_node* node = (struct fd_node*) (uintptr_t) data;
+
+        uring_cqe_seen(uring);
+
+        if (data == FD_LIST_URING_NOTIFY) {
+            if (res < 0) {
+                fprintf(stderr, "notify: %s\n", strerror(-res));
+            }
+            continue;
+        }
+        if (data == FD_LIST_URING_CANCEL) {
+            continue;
+        }
+
+        node->armed = 0;
+        if (node->fd < 0) {
+            struct fd_node** prev = &fd_list->dead;
+
+            while (*prev != node) {
+                prev = &(*prev)->next;
+            }
+            *prev = node->next;
+            free(node);
+            continue;
+        }
+
+        n += process_cqe(fd_list, node, res);
+    }
+
+    return n;
+}
+
+int traverse_fd_list(FdList* fd_list)
+{
+    return fd_list->uring ? traverse_uring(fd_list) : traverse_epoll(fd_list);
+}
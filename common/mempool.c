@@ -0,0 +1,246 @@
+/*
+ * mempool.c
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mempool.h"
+#include "common.h"
+
+#define MEMPOOL_ALIGNMENT   64
+
+static inline PktBuf* _pool_buf(Mempool* pool, uint32_t idx)
+{
+    return (PktBuf*) (pool->mem + (size_t) idx * pool->elt_size);
+}
+
+Mempool* new_mempool(uint32_t num, uint32_t data_size)
+{
+    Mempool* pool = (Mempool*) calloc(1, sizeof(Mempool));
+    uint32_t idx;
+
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->num = num;
+    pool->data_size = data_size;
+    pool->elt_size = ALIGN(sizeof(PktBuf) + data_size, MEMPOOL_ALIGNMENT);
+    pool->free = (PktBuf**) calloc(num, sizeof(PktBuf*));
+    if (!pool->free || posix_memalign((void**) &pool->mem, MEMPOOL_ALIGNMENT,
+            (size_t) num * pool->elt_size) != 0) {
+        free(pool->free);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+
+    for (idx = 0; idx < num; idx++) {
+        PktBuf* buf = _pool_buf(pool, idx);
+
+        buf->pool = pool;
+        atomic_init(&buf->refcnt, 0);
+        pool->free[idx] = buf;
+    }
+    pool->free_num = num;
+
+    return pool;
+}
+
+// 所有cache都要先flush，或者不再使用
+void free_mempool(Mempool* pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->mem);
+    free(pool->free);
+    free(pool);
+}
+
+// 从pool整批取n个，不够时不取
+static int _pool_get(Mempool* pool, PktBuf* bufs[], uint32_t n)
+{
+    int r = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_num >= n) {
+        pool->free_num -= n;
+        memcpy(bufs, &pool->free[pool->free_num], n * sizeof(PktBuf*));
+        r = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return r;
+}
+
+static void _pool_put(Mempool* pool, PktBuf* const bufs[], uint32_t n)
+{
+    pthread_mutex_lock(&pool->lock);
+    memcpy(&pool->free[pool->free_num], bufs, n * sizeof(PktBuf*));
+    pool->free_num += n;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void init_mempool_cache(MempoolCache* cache, Mempool* pool)
+{
+    cache->pool = pool;
+    cache->num = 0;
+}
+
+// 缓存的buffer全部还给pool
+void flush_mempool_cache(MempoolCache* cache)
+{
+    if (cache->num) {
+        _pool_put(cache->pool, cache->bufs, cache->num);
+        cache->num = 0;
+    }
+}
+
+// 取n个buffer，引用计数为1，不够时一个也不取返回-1
+int alloc_pktbuf_bulk(MempoolCache* cache, PktBuf* bufs[], uint32_t n)
+{
+    uint32_t i;
+
+    if (n > cache->num) {
+        // a large request bypasses the cache, a small one refills it
+        if (n > MEMPOOL_CACHE_SIZE / 2) {
+            if (_pool_get(cache->pool, bufs, n) != 0) {
+                return -1;
+            }
+            goto init;
+        }
+        if (_pool_get(cache->pool, cache->bufs + cache->num, MEMPOOL_CACHE_SIZE / 2) == 0) {
+            cache->num += MEMPOOL_CACHE_SIZE / 2;
+        } else if (_pool_get(cache->pool, cache->bufs + cache->num, n - cache->num) == 0) {
+            // the pool is running out, take just what is missing
+            cache->num = n;
+        } else {
+            return -1;
+        }
+    }
+
+    cache->num -= n;
+    memcpy(bufs, &cache->bufs[cache->num], n * sizeof(PktBuf*));
+
+init:
+    for (i = 0; i < n; i++) {
+        bufs[i]->next = NULL;
+        bufs[i]->len = 0;
+        bufs[i]->pkt_len = 0;
+        atomic_store_explicit(&bufs[i]->refcnt, 1, memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+PktBuf* alloc_pktbuf(MempoolCache* cache)
+{
+    PktBuf* buf;
+
+    return alloc_pktbuf_bulk(cache, &buf, 1) == 0 ? buf : NULL;
+}
+
+// 每个segment都多一个引用
+void ref_pktbuf(PktBuf* buf)
+{
+    for (; buf; buf = buf->next) {
+        atomic_fetch_add_explicit(&buf->refcnt, 1, memory_order_relaxed);
+    }
+}
+
+/* 每个segment减一个引用，减到0的放入cache，cache满了还回去一半
+ * 别的pool的buffer直接还给它自己的pool
+ */
+void free_pktbuf(MempoolCache* cache, PktBuf* buf)
+{
+    while (buf) {
+        PktBuf* next = buf->next;
+
+        if (atomic_fetch_sub_explicit(&buf->refcnt, 1, memory_order_acq_rel) == 1) {
+            if (buf->pool != cache->pool) {
+                _pool_put(buf->pool, &buf, 1);
+            } else {
+                if (cache->num == MEMPOOL_CACHE_SIZE) {
+                    cache->num -= MEMPOOL_CACHE_SIZE / 2;
+                    _pool_put(cache->pool, cache->bufs + cache->num, MEMPOOL_CACHE_SIZE / 2);
+                }
+                cache->bufs[cache->num++] = buf;
+            }
+        }
+        buf = next;
+    }
+}
+
+// 把pkt的包头和数据拷到新的一串PktBuf，buffer不够或包太大时返回NULL
+PktBuf* new_pktbuf(MempoolCache* cache, const VringPacket* pkt)
+{
+    PktBuf* bufs[VRING_IOV_MAX];
+    uint32_t data_size = cache->pool->data_size;
+    size_t size = 0;
+    size_t off = 0;
+    uint32_t n, i;
+
+    for (i = 0; i < pkt->iov_cnt; i++) {
+        size += pkt->iov[i].iov_len;
+    }
+
+    n = MAX(1, (size + data_size - 1) / data_size);
+    if (n > VRING_IOV_MAX || alloc_pktbuf_bulk(cache, bufs, n) != 0) {
+        return NULL;
+    }
+
+    bufs[0]->pkt_len = size;
+    bufs[0]->hdr = pkt->hdr;
+
+    for (i = 0; i < n; i++) {
+        bufs[i]->len = MIN(data_size, size - (size_t) i * data_size);
+        bufs[i]->next = (i + 1 < n) ? bufs[i + 1] : NULL;
+    }
+
+    // segment boundaries of the iov and of the bufs don't line up
+    for (i = 0; i < pkt->iov_cnt; i++) {
+        const uint8_t* p = (const uint8_t*) pkt->iov[i].iov_base;
+        size_t len = pkt->iov[i].iov_len;
+
+        while (len) {
+            PktBuf* buf = bufs[off / data_size];
+            size_t at = off % data_size;
+            size_t chunk = MIN(len, data_size - at);
+
+            memcpy(buf->data + at, p, chunk);
+            p += chunk;
+            len -= chunk;
+            off += chunk;
+        }
+    }
+
+    return bufs[0];
+}
+
+// pkt的iov指向buf的各segment，不拷贝数据，buf释放前有效
+int pktbuf_to_packet(const PktBuf* buf, VringPacket* pkt)
+{
+    pkt->hdr = buf->hdr;
+    pkt->size = buf->pkt_len;
+    pkt->iov_cnt = 0;
+
+    for (; buf; buf = buf->next) {
+        if (!buf->len) {
+            continue;
+        }
+        if (pkt->iov_cnt == VRING_IOV_MAX) {
+            return -1;
+        }
+        pkt->iov[pkt->iov_cnt].iov_base = (void*) buf->data;
+        pkt->iov[pkt->iov_cnt].iov_len = buf->len;
+        pkt->iov_cnt++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * numa_util.c
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "numa_util.h"
+
+#define NUMA_SYSFS_NODE     "/sys/devices/system/node"
+#define NUMA_SYSFS_CPU      "/sys/devices/system/cpu"
+
+// 最大node号加1，格式是"0-3"或"0,2"这样的列表
+int numa_num_nodes(void)
+{
+    FILE* f = fopen(NUMA_SYSFS_NODE "/online", "r");
+    int num = 1;
+    int node;
+    char sep;
+
+    if (!f) {
+        return 1;
+    }
+
+    while (fscanf(f, "%d%c", &node, &sep) >= 1) {
+        if (node + 1 > num) {
+            num = node + 1;
+        }
+    }
+    fclose(f);
+
+    return num < NUMA_NODES_MAX ? num : NUMA_NODES_MAX;
+}
+
+// addr所在页面实际分配在哪个node，页面还没分配时会先分配
+int numa_node_of_addr(const void* addr)
+{
+    int node = -1;
+
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        // a kernel without CONFIG_NUMA has a single node
+        return errno == ENOSYS ? 0 : -1;
+    }
+
+    return node;
+}
+
+// sysfs里cpuN目录下有nodeM的链接
+int numa_node_of_cpu(int cpu)
+{
+    char path[64];
+    struct dirent* entry;
+    DIR* dir;
+    int node = 0;
+
+    if (cpu < 0) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), NUMA_SYSFS_CPU "/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+/* 把[addr, addr + len)里完整的页面绑定到node，已经分配的页面迁移过去
+ * 不完整的首尾页面可能和别的数据共享，保持不变
+ */
+int numa_bind(void* addr, size_t len, int node)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) addr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) addr + len) & ~(page - 1);
+    unsigned long mask;
+
+    if (node < 0 || node >= NUMA_NODES_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (end <= start) {
+        return 0;
+    }
+
+    mask = 1UL << node;
+    if (syscall(SYS_mbind, start, end - start, MPOL_BIND, &mask,
+            NUMA_NODES_MAX + 1, MPOL_MF_MOVE) != 0) {
+        return errno == ENOSYS && node == 0 ? 0 : -1;
+    }
+
+    return 0;
+}
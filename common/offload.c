@@ -0,0 +1,250 @@
+/*
+ * offload.c
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <string.h>
+
+#include "offload.h"
+#include "common.h"
+
+#define ETH_HLEN            14
+#define ETH_P_IP            0x0800
+#define ETH_P_IPV6          0x86dd
+#define ETH_P_8021Q         0x8100
+#define IPV6_HLEN           40
+#define IPPROTO_TCP_        6
+
+#define TCP_F_FIN           0x01
+#define TCP_F_PSH           0x08
+#define TCP_F_CWR           0x80
+
+static inline uint16_t _get16(const uint8_t* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t _get32(const uint8_t* p)
+{
+    return ((uint32_t)_get16(p) << 16) | _get16(p + 2);
+}
+
+static inline void _put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static inline void _put32(uint8_t* p, uint32_t v)
+{
+    _put16(p, v >> 16);
+    _put16(p + 2, v & 0xffff);
+}
+
+// ones' complement sum of len bytes, in network order
+static uint64_t _csum_add(uint64_t sum, const uint8_t* p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += _get16(p + i);
+    }
+    if (len & 1) {
+        sum += p[len - 1] << 8;
+    }
+
+    return sum;
+}
+
+static uint16_t _csum_fold(uint64_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+/* 目的端按协商的特性 (GUEST_CSUM/GUEST_TSO4/GUEST_TSO6) 能否收下这个包
+ * 返回1表示要先用sw_offload在软件里做校验和或分段
+ */
+int need_sw_offload(uint64_t features, const VringPacket* pkt)
+{
+    const struct virtio_net_hdr* hdr = &pkt->hdr.hdr;
+    int ecn = hdr->gso_type & VIRTIO_NET_HDR_GSO_ECN;
+
+    if (ecn && !((features >> VIRTIO_NET_F_GUEST_ECN) & 1)) {
+        return 1;
+    }
+
+    switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+        break;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+        return !((features >> VIRTIO_NET_F_GUEST_TSO4) & 1);
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        return !((features >> VIRTIO_NET_F_GUEST_TSO6) & 1);
+    default:
+        // UFO is never negotiated, sw_offload drops it
+        return 1;
+    }
+
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+            && !((features >> VIRTIO_NET_F_GUEST_CSUM) & 1);
+}
+
+// 处理后的包，包头全0，校验和已经是完整的
+static void _set_pkt(VringPacket* pkt, uint8_t* data, size_t size)
+{
+    memset(&pkt->hdr, 0, sizeof(pkt->hdr));
+    pkt->iov[0].iov_base = data;
+    pkt->iov[0].iov_len = size;
+    pkt->iov_cnt = 1;
+    pkt->size = size;
+}
+
+/* VIRTIO_NET_HDR_F_NEEDS_CSUM：csum_start到帧尾求和，写到csum_start + csum_offset
+ * 那里原有的值是伪首部的部分和
+ */
+static int _csum_partial(uint8_t* frame, size_t size, const struct virtio_net_hdr* hdr)
+{
+    size_t start = hdr->csum_start;
+    size_t off = start + hdr->csum_offset;
+
+    if (off + sizeof(uint16_t) > size) {
+        return -1;
+    }
+
+    _put16(frame + off, _csum_fold(_csum_add(0, frame + start, size - start)));
+
+    return 0;
+}
+
+/* 软件TSO：把frame按gso_size切成多个TCP段，每段带一份首部
+ * 更新IP长度/id/校验和、TCP序号/标志，TCP校验和整个重算
+ */
+static int _tso(Offload* offload, size_t size, const struct virtio_net_hdr* hdr, int ipv6)
+{
+    uint8_t* frame = offload->frame;
+    uint8_t* seg = offload->seg;
+    size_t l3 = ETH_HLEN;
+    size_t l4, hlen, payload, mss = hdr->gso_size;
+    uint16_t proto = _get16(frame + 12);
+    uint16_t ip_id = 0;
+    uint32_t seq;
+    uint32_t k, nseg;
+
+    if (proto == ETH_P_8021Q) {
+        l3 += 4;
+        proto = _get16(frame + 16);
+    }
+
+    if (!mss || size < l3 + IPV6_HLEN || proto != (ipv6 ? ETH_P_IPV6 : ETH_P_IP)) {
+        return -1;
+    }
+
+    if (ipv6) {
+        l4 = l3 + IPV6_HLEN;
+        if (frame[l3 + 6] != IPPROTO_TCP_) {
+            // extension headers, the guest told where TCP starts
+            if (!(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+                return -1;
+            }
+            l4 = hdr->csum_start;
+        }
+    } else {
+        l4 = l3 + (frame[l3] & 0x0f) * 4;
+        ip_id = _get16(frame + l3 + 4);
+        if (frame[l3 + 9] != IPPROTO_TCP_) {
+            return -1;
+        }
+    }
+
+    if (l4 + 20 > size) {
+        return -1;
+    }
+    hlen = l4 + (frame[l4 + 12] >> 4) * 4;
+    if (hlen > size || hlen > OFFLOAD_HDR_MAX) {
+        return -1;
+    }
+
+    payload = size - hlen;
+    nseg = payload ? (payload + mss - 1) / mss : 1;
+    if (nseg > OFFLOAD_SEG_MAX) {
+        return -1;
+    }
+
+    seq = _get32(frame + l4 + 4);
+
+    for (k = 0; k < nseg; k++) {
+        size_t len = MIN(mss, payload - k * mss);
+        size_t tcp_len = hlen - l4 + len;
+        uint64_t sum;
+
+        memcpy(seg, frame, hlen);
+        memcpy(seg + hlen, frame + hlen + k * mss, len);
+
+        if (ipv6) {
+            _put16(seg + l3 + 4, hlen - l3 - IPV6_HLEN + len);
+            sum = _csum_add(0, seg + l3 + 8, 32);
+        } else {
+            _put16(seg + l3 + 2, hlen - l3 + len);
+            _put16(seg + l3 + 4, ip_id + k);
+            _put16(seg + l3 + 10, 0);
+            _put16(seg + l3 + 10, _csum_fold(_csum_add(0, seg + l3, l4 - l3)));
+            sum = _csum_add(0, seg + l3 + 12, 8);
+        }
+
+        _put32(seg + l4 + 4, seq + k * mss);
+        if (k + 1 < nseg) {
+            seg[l4 + 13] &= ~(TCP_F_FIN | TCP_F_PSH);
+        }
+        if (k > 0) {
+            seg[l4 + 13] &= ~TCP_F_CWR;
+        }
+
+        // pseudo header, then the segment
+        sum += IPPROTO_TCP_ + tcp_len;
+        _put16(seg + l4 + 16, 0);
+        _put16(seg + l4 + 16, _csum_fold(_csum_add(sum, seg + l4, tcp_len)));
+
+        _set_pkt(&offload->pkts[k], seg, hlen + len);
+        seg += hlen + len;
+    }
+
+    return nseg;
+}
+
+/* 目的端不接受的offload在软件里做完：GSO帧分段，部分校验和补全
+ * 结果在offload->pkts，返回包数，处理不了的包返回-1，由调用者丢弃
+ */
+int sw_offload(Offload* offload, const VringPacket* pkt)
+{
+    const struct virtio_net_hdr* hdr = &pkt->hdr.hdr;
+    size_t size = iov_to_buf(pkt->iov, pkt->iov_cnt, offload->frame, sizeof(offload->frame));
+
+    if (size != pkt->size) {
+        return -1;
+    }
+
+    switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+        if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+                && _csum_partial(offload->frame, size, hdr) != 0) {
+            return -1;
+        }
+        _set_pkt(&offload->pkts[0], offload->frame, size);
+        return 1;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+        return _tso(offload, size, hdr, 0);
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        return _tso(offload, size, hdr, 1);
+    default:
+        return -1;
+    }
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -21,53 +23,134 @@
  * Common code for shared memory
  */
 
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB         0x0004U
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT      26
+#endif
+
 int shm_fds[VHOST_MEMORY_MAX_NREGIONS];
+size_t shm_page_sizes[VHOST_MEMORY_MAX_NREGIONS];
+
+static const char* _page_size_name(size_t page_size)
+{
+    switch (page_size) {
+    case SHM_PAGE_SIZE_1G:
+        return "1G";
+    case SHM_PAGE_SIZE_2M:
+        return "2M";
+    default:
+        return "4K";
+    }
+}
 
-/* 创建一个RW的共享内存 */
-// 创建的fd在/dev/shm
-void* create_shm(size_t size, int idx)
+static void* _map(int fd, size_t size, int flags)
+{
+    void* result = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | ((flags & SHM_F_POPULATE) ? MAP_POPULATE : 0), fd, 0);
+
+    if (result == MAP_FAILED) {
+        return 0;
+    }
+
+    // a locked region never faults on the data path, failing to lock is not fatal
+    if ((flags & SHM_F_LOCK) && mlock(result, size) != 0) {
+        perror("mlock");
+    }
+
+    return result;
+}
+
+/* 匿名的memfd，page_size为4K以外时用MFD_HUGETLB，size按页对齐
+ * 大小固定后加seal，对端拿到fd也不能改变大小，加不上seal就返回0
+ * 没有预留大页时ftruncate或mmap失败，返回0，由调用者换小一级的页
+ */
+static void* _create_memfd(size_t size, size_t page_size, int idx)
 {
-    int fd = 0;
-    void* result = 0;
     char name[PATH_MAX];
-    int oflags = 0;
+    unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+    void* result;
+    int fd;
 
-    sprintf(name, "%s%d", SHM_NAME_PREFIX, idx);
+    if (page_size != SHM_PAGE_SIZE_4K) {
+        flags |= MFD_HUGETLB | (__builtin_ctzl(page_size) << MFD_HUGE_SHIFT);
+    }
 
-    oflags = O_RDWR | O_CREAT;
+    // the name only shows up in /proc/<pid>/fd, two clients may use the same one
+    sprintf(name, "%s%d", SHM_NAME_PREFIX, idx);
 
-    fd = shm_open(name, oflags, 0666);
+    fd = memfd_create(name, flags);
     if (fd == -1) {
-        perror("shm_open");
-        goto err;
+        return 0;
     }
 
     if (ftruncate(fd, size) != 0) {
-        perror("ftruncate");
-        goto err;
+        close(fd);
+        return 0;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        perror("F_ADD_SEALS");
+        close(fd);
+        return 0;
     }
 
-    // 按man的说明，映射后fd其实可以关闭
-    result = map_shm(fd, size);
+    result = _map(fd, size, SHM_MAP_FLAGS);
     if (!result) {
-        goto err;
+        close(fd);
+        return 0;
     }
 
     shm_fds[idx] = fd;
 
     return result;
+}
+
+/* 创建一个RW的共享内存，*size返回按页对齐后的大小
+ * 依次试1G (不小于1G的region)、2M大页，都没有时用4K页
+ * 用的页大小记在shm_page_sizes[idx]
+ */
+void* create_shm(size_t* size, int idx)
+{
+    static const size_t page_sizes[] = {
+#ifndef SHM_NO_HUGEPAGES
+        SHM_PAGE_SIZE_1G, SHM_PAGE_SIZE_2M,
+#endif
+        SHM_PAGE_SIZE_4K
+    };
+    uint32_t i;
+
+    for (i = 0; i < sizeof(page_sizes) / sizeof(page_sizes[0]); i++) {
+        size_t page_size = page_sizes[i];
+        size_t aligned = ALIGN(*size, page_size);
+        void* result;
+
+        // a 1G page for a small region wastes most of it
+        if (page_size == SHM_PAGE_SIZE_1G && *size < SHM_PAGE_SIZE_1G) {
+            continue;
+        }
+
+        result = _create_memfd(aligned, page_size, idx);
+        if (result) {
+            *size = aligned;
+            shm_page_sizes[idx] = page_size;
+            fprintf(stdout, "shm %d: %zu bytes on %s pages\n", idx, *size,
+                    _page_size_name(page_size));
+            return result;
+        }
+    }
+
+    perror("memfd_create");
 
-err:
-    close(fd);
     return 0;
 }
 
-/* 映身共享内存 */
-void* map_shm(int fd, size_t size) {
-    void *result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (result == MAP_FAILED) {
+/* 映身共享内存，flags见SHM_F_POPULATE和SHM_F_LOCK */
+void* map_shm(int fd, size_t size, int flags) {
+    void *result = _map(fd, size, flags);
+    if (!result) {
         perror("mmap");
-        result = 0;
     }
     return result;
 }
@@ -81,11 +164,11 @@ int unmap_shm(void* ptr, size_t size) {
     return 0;
 }
 
-/* 取消共享内存映射并删除共享内存fd */
+/* 取消共享内存映射并关闭共享内存fd
+ * memfd没有名字，对端也关闭后内存就释放了
+ */
 int end_shm(void* ptr, size_t size, int idx)
 {
-    char name[PATH_MAX];
-
     if (shm_fds[idx] > 0) {
         close(shm_fds[idx]);
         shm_fds[idx] = -1;
@@ -96,13 +179,6 @@ int end_shm(void* ptr, size_t size, int idx)
         return -1;
     }
 
-    sprintf(name, "%s%d", SHM_NAME_PREFIX, idx);
-    LOG("%s: remove shared memory %d, name %s\n", __FUNCTION__, idx, name);
-    if (shm_unlink(name) != 0) {
-        perror("shm_unlink");
-        return -1;
-    }
-
     return 0;
 }
 
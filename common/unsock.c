@@ -15,6 +15,7 @@ UnSock* new_unsock(const char* path)
 {
     UnSock* s = (UnSock*) calloc(1, sizeof(UnSock));
     strncpy(s->sock_path, path ? path : VHOST_SOCK_NAME, PATH_MAX);
+    s->fd_list.epfd = -1;   // init_unsock sets it up
     return s;
 }
 
@@ -29,6 +30,7 @@ int close_unsock(UnSock* s)
             unlink(s->sock_path);
         }
     }
+    end_fd_list(&s->fd_list);
 
     return 0;
 }
@@ -43,14 +45,16 @@ int init_unsock(UnSock *unsock, int is_listen, int poll_interval, fd_handler_t h
         return -1;
     }
 
+    if (init_fd_list(&unsock->fd_list, poll_interval) != 0) {
+        return -1;
+    }
+
     // Create the socket
     if ((unsock->sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
         perror("socket");
         return -1;
     }
 
-    init_fd_list(&unsock->fd_list, poll_interval);
-
     // sock bind/connect
     un.sun_family = AF_UNIX;
     strcpy(un.sun_path, unsock->sock_path);
@@ -0,0 +1,200 @@
+/*
+ * uring.c
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* head/tail是和内核之间的同步点，和vring的idx一样：
+ * 先写sqe再发布sq tail (release)，先读cq tail再读cqe (acquire)
+ */
+static inline uint32_t uring_load_acquire(const uint32_t* p)
+{
+    uint32_t v = *(volatile const uint32_t*) p;
+    atomic_thread_fence(memory_order_acquire);
+    return v;
+}
+
+static inline void uring_store_release(uint32_t* p, uint32_t v)
+{
+    atomic_thread_fence(memory_order_release);
+    *(volatile uint32_t*) p = v;
+}
+
+/* sqpoll_ms不为0时由内核线程轮询SQ，空闲sqpoll_ms之后睡眠
+ * 需要IORING_FEAT_EXT_ARG (5.11)，不支持时返回-1，调用者退回到别的方式
+ */
+int init_uring(Uring* uring, uint32_t entries, uint32_t sqpoll_ms)
+{
+    struct io_uring_params p;
+    uint32_t idx;
+    size_t sq_size, cq_size;
+    void* ptr;
+
+    memset(uring, 0, sizeof(*uring));
+    memset(&p, 0, sizeof(p));
+    if (sqpoll_ms) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = sqpoll_ms;
+    }
+
+    uring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (uring->fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(uring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ptr = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            uring->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        close(uring->fd);
+        return -1;
+    }
+    uring->ring = ptr;
+
+    ptr = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            uring->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        munmap(uring->ring, uring->ring_size);
+        close(uring->fd);
+        return -1;
+    }
+    uring->sqes = (struct io_uring_sqe*) ptr;
+
+    uring->flags = p.flags;
+    uring->sq_entries = p.sq_entries;
+    uring->sq_head = (uint32_t*) ((char*) uring->ring + p.sq_off.head);
+    uring->sq_tail = (uint32_t*) ((char*) uring->ring + p.sq_off.tail);
+    uring->sq_mask = (uint32_t*) ((char*) uring->ring + p.sq_off.ring_mask);
+    uring->sq_flags = (uint32_t*) ((char*) uring->ring + p.sq_off.flags);
+    uring->sq_array = (uint32_t*) ((char*) uring->ring + p.sq_off.array);
+    uring->cq_head = (uint32_t*) ((char*) uring->ring + p.cq_off.head);
+    uring->cq_tail = (uint32_t*) ((char*) uring->ring + p.cq_off.tail);
+    uring->cq_mask = (uint32_t*) ((char*) uring->ring + p.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*) ((char*) uring->ring + p.cq_off.cqes);
+    uring->sqe_tail = *uring->sq_tail;
+
+    // sq slot i always holds sqe i, sqes are used in ring order
+    for (idx = 0; idx < p.sq_entries; idx++) {
+        uring->sq_array[idx] = idx;
+    }
+
+    return 0;
+}
+
+// 关闭后内核取消所有还没完成的请求
+void end_uring(Uring* uring)
+{
+    munmap(uring->sqes, uring->sqes_size);
+    munmap(uring->ring, uring->ring_size);
+    close(uring->fd);
+    uring->fd = -1;
+}
+
+// 取一个清零的sqe，SQ满时返回NULL，要先uring_submit
+struct io_uring_sqe* uring_get_sqe(Uring* uring)
+{
+    struct io_uring_sqe* sqe;
+
+    if (uring->sqe_tail - uring_load_acquire(uring->sq_head) >= uring->sq_entries) {
+        return NULL;
+    }
+
+    sqe = &uring->sqes[uring->sqe_tail & *uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sqe_tail++;
+
+    return sqe;
+}
+
+/* 发布取出的sqe，等到至少wait_nr个cqe，或者ms超时 (-1一直等)
+ * SQPOLL时内核线程自己取sqe，只在它睡眠后才唤醒，不等cqe时通常不需要系统调用
+ */
+int uring_submit(Uring* uring, uint32_t wait_nr, int ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    uint32_t submit = 0;
+    uint32_t flags = 0;
+    int r;
+
+    if (uring->sqe_tail != *uring->sq_tail) {
+        uring_store_release(uring->sq_tail, uring->sqe_tail);
+    }
+
+    if (uring->flags & IORING_SETUP_SQPOLL) {
+        // the tail store has to be visible before the flag is looked at
+        atomic_thread_fence(memory_order_seq_cst);
+        if (*(volatile uint32_t*) uring->sq_flags & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        // a full SQ waits for the kernel thread to make room
+        if (uring->sqe_tail - uring_load_acquire(uring->sq_head) >= uring->sq_entries) {
+            flags |= IORING_ENTER_SQ_WAIT;
+        }
+    } else {
+        submit = uring->sqe_tail - uring_load_acquire(uring->sq_head);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (ms >= 0) {
+            ts.tv_sec = ms / 1000;
+            ts.tv_nsec = (ms % 1000) * 1000000L;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+    }
+
+    if (!submit && !flags) {
+        return 0;
+    }
+
+    r = syscall(__NR_io_uring_enter, uring->fd, submit, wait_nr, flags,
+            wait_nr ? &arg : NULL, wait_nr ? sizeof(arg) : 0);
+    if (r < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY)) {
+        return 0;
+    }
+
+    return r;
+}
+
+// 下一个完成的cqe，没有时返回NULL，用完要调uring_cqe_seen
+struct io_uring_cqe* uring_peek_cqe(Uring* uring)
+{
+    uint32_t head = *uring->cq_head;
+
+    if (head == uring_load_acquire(uring->cq_tail)) {
+        return NULL;
+    }
+
+    return &uring->cqes[head & *uring->cq_mask];
+}
+
+void uring_cqe_seen(Uring* uring)
+{
+    uring_store_release(uring->cq_head, *uring->cq_head + 1);
+}
@@ -12,17 +12,49 @@
 #define VRING_C_
 
 #include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
 
 #include "vring.h"
+#include "vring_simd.h"
 #include "common.h"
-#include "shm.h"
 #include "vhost_user.h"
 
-#define VRING_IDX_NONE          ((uint16_t)-1)
+/* avail->idx和used->idx是两个进程之间的同步点，不需要msync，
+ * 只要保证：生产者先写desc/ring再发布idx (release)，
+ * 消费者先读idx再读desc/ring (acquire)
+ */
+static inline uint16_t vring_load_acquire(const uint16_t* idx)
+{
+    uint16_t v = *(volatile const uint16_t*) idx;
+    atomic_thread_fence(memory_order_acquire);
+    return v;
+}
+
+static inline void vring_store_release(uint16_t* idx, uint16_t v)
+{
+    atomic_thread_fence(memory_order_release);
+    *(volatile uint16_t*) idx = v;
+}
+
+// 预取只是提示，地址无效也不会出错
+static inline void vring_prefetch(const void* addr)
+{
+    __builtin_prefetch(addr, 0, 3);
+}
+
+/* VRING_F_EVENT_IDX: 对端要求在event_idx处通知，
+ * 本次从old发布到new，event_idx落在[old, new)内就需要通知
+ */
+static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
 
 // 初始化vring结构体
 int init_vring(VringTable *vring_table, uint32_t v_idx)
@@ -35,61 +67,181 @@ int init_vring(VringTable *vring_table, uint32_t v_idx)
     vring_table->vring[v_idx].num = 0;
     vring_table->vring[v_idx].last_avail_idx = 0;
     vring_table->vring[v_idx].last_used_idx = 0;
+    vring_table->vring[v_idx].avail_wrap_counter = 1;
+    vring_table->vring[v_idx].used_wrap_counter = 1;
+    vring_table->vring[v_idx].num_free = 0;
+    vring_table->vring[v_idx].free_ids = NULL;
+    vring_table->vring[v_idx].chain_len = NULL;
+    vring_table->vring[v_idx].num_added = 0;
+    vring_table->vring[v_idx].notify_off = 0;
+    vring_table->vring[v_idx].enabled = 0;
+    return 0;
+}
+
+// 分配num_vrings个vring (每个queue pair两个) 并初始化
+int init_vring_table(VringTable* vring_table, uint32_t num_vrings)
+{
+    uint32_t idx;
+
+    vring_table->vring = (Vring*) calloc(num_vrings, sizeof(Vring));
+    if (!vring_table->vring) {
+        vring_table->num_vrings = 0;
+        return -1;
+    }
+    vring_table->num_vrings = num_vrings;
+
+    for (idx = 0; idx < num_vrings; idx++) {
+        init_vring(vring_table, idx);
+    }
+
+    return 0;
+}
+
+void free_vring_table(VringTable* vring_table)
+{
+    uint32_t idx;
+
+    for (idx = 0; idx < vring_table->num_vrings; idx++) {
+        free(vring_table->vring[idx].free_ids);
+        free(vring_table->vring[idx].chain_len);
+    }
+    free(vring_table->vring);
+    vring_table->vring = NULL;
+    vring_table->num_vrings = 0;
+}
+
+/* 设置vring的起始位置，num必须已设置
+ * split ring: 消费者的last_avail_idx，生产者的desc全部放回空闲栈
+ * packed ring: bit 0-14 slot，bit 15 wrap counter，生产者和消费者都从这里开始
+ */
+int set_vring_base(VringTable *vring_table, uint32_t v_idx, uint32_t base)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        uint16_t* chain_len = (uint16_t*) realloc(vring->chain_len, vring->num * sizeof(uint16_t));
+
+        if (!chain_len) {
+            return -1;
+        }
+
+        vring->chain_len = chain_len;
+        vring->last_avail_idx = base & ~(1 << VRING_PACKED_WRAP_COUNTER_BIT);
+        vring->last_used_idx = vring->last_avail_idx;
+        vring->avail_wrap_counter = (base >> VRING_PACKED_WRAP_COUNTER_BIT) & 1;
+        vring->used_wrap_counter = vring->avail_wrap_counter;
+        vring->num_free = vring->num;
+    } else {
+        uint16_t* free_ids = (uint16_t*) realloc(vring->free_ids, vring->num * sizeof(uint16_t));
+        uint32_t i;
+
+        if (!free_ids) {
+            return -1;
+        }
+
+        // popped from the top, desc 0 goes first
+        for (i = 0; i < vring->num; i++) {
+            free_ids[i] = vring->num - 1 - i;
+        }
+        vring->free_ids = free_ids;
+        vring->num_free = vring->num;
+        vring->last_avail_idx = base;
+    }
+
     return 0;
 }
 
-/* Initialize a vhost_vring structure from the provided base
-   address of shared memory. */
-struct vhost_vring* new_vring(void* vring_base)
+uint32_t get_vring_base(VringTable *vring_table, uint32_t v_idx)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        return vring->last_avail_idx
+                | (vring->avail_wrap_counter << VRING_PACKED_WRAP_COUNTER_BIT);
+    }
+
+    return vring->last_avail_idx;
+}
+
+// 共享内存里一个num大小的vring加上它的buffer占用的字节数
+size_t vring_mem_size(unsigned int num)
+{
+    return ALIGN(vring_size(num), BUFFER_ALIGNMENT) + num * ALIGN(BUFFER_SIZE, BUFFER_ALIGNMENT);
+}
+
+/* Initialize a vhost_vring structure of num entries from the provided base
+   address of shared memory, vring_mem_size(num) bytes. */
+struct vhost_vring* new_vring(void* vring_base, unsigned int num, uint64_t features)
 {
     struct vhost_vring* vring = (struct vhost_vring*) vring_base;
+    struct vring_packed_desc* pdesc = (struct vring_packed_desc*) vring->desc;
+    struct vring_avail* avail;
+    struct vring_used* used;
+    int packed = (features >> VIRTIO_F_RING_PACKED) & 1;
     int i = 0;
     // 游标，用来初始化desc里的buffer地址
-    uintptr_t ptr = (uintptr_t) ((char*)vring + sizeof(struct vhost_vring));
-    size_t initialized_size = 0;
+    uintptr_t ptr = (uintptr_t) ((char*)vring + vring_size(num));
+
+    // the split ring indexes wrap at 65536, its size has to divide that
+    if (num == 0 || num > VHOST_VRING_SIZE || (!packed && (num & (num - 1)))) {
+        return NULL;
+    }
+
+    vring->num = num;
+    avail = vhost_vring_avail(vring);
+    used = vhost_vring_used(vring);
 
     // Layout the descriptor table
-    for (i = 0; i < VHOST_VRING_SIZE; i++) {
+    for (i = 0; i < num; i++) {
         // align the pointer
         ptr = ALIGN(ptr, BUFFER_ALIGNMENT);
 
-        vring->desc[i].addr = ptr;
-        vring->desc[i].len = BUFFER_SIZE;
-        vring->desc[i].flags = VIRTIO_DESC_F_WRITE;
-        vring->desc[i].next = i+1;
+        if (packed) {
+            // each slot owns its buffer, neither AVAIL nor USED is set
+            pdesc[i].addr = ptr;
+            pdesc[i].len = BUFFER_SIZE;
+            pdesc[i].id = i;
+            pdesc[i].flags = 0;
+        } else {
+            vring->desc[i].addr = ptr;
+            vring->desc[i].len = BUFFER_SIZE;
+            vring->desc[i].flags = VIRTIO_DESC_F_WRITE;
+            vring->desc[i].next = 0;
+        }
 
-        ptr += vring->desc[i].len;
+        ptr += BUFFER_SIZE;
     }
 
-    initialized_size = ptr - (uintptr_t)vring_base;
-
-    vring->desc[VHOST_VRING_SIZE-1].next = VRING_IDX_NONE;
-
-    vring->avail.idx = 0;
-    vring->used.idx =  0;
-
-    sync_shm(vring_base, initialized_size);
+    // for the packed ring these are the event suppression structures
+    avail->flags = 0;
+    avail->idx = 0;
+    *vring_used_event(avail, num) = 0;
+    used->flags = 0;
+    used->idx =  0;
+    *vring_avail_event(used, num) = 0;
 
     return vring;
 }
 
 // TODO 不属于vring，提取到vhost-user
 // 初化流程的一部分，设置vring
-int set_host_vring(UnSock* client, struct vhost_vring *vring, int index)
+int set_host_vring(UnSock* client, struct vhost_vring *vring, int index, uint64_t features)
 {
     vring->kickfd = eventfd(0, EFD_NONBLOCK);
     vring->callfd = eventfd(0, EFD_NONBLOCK);
     assert(vring->kickfd >= 0);
     assert(vring->callfd >= 0);
 
-    struct vhost_vring_state num = { .index = index, .num = VHOST_VRING_SIZE };
-    struct vhost_vring_state base = { .index = index, .num = 0 };
+    struct vhost_vring_state num = { .index = index, .num = vring->num };
+    // a packed ring starts with the wrap counter set
+    struct vhost_vring_state base = { .index = index,
+            .num = ((features >> VIRTIO_F_RING_PACKED) & 1) << VRING_PACKED_WRAP_COUNTER_BIT };
     struct vhost_vring_file kick = { .index = index, .fd = vring->kickfd };
     struct vhost_vring_file call = { .index = index, .fd = vring->callfd }; // callfd并没有哪端在监听，why?
     struct vhost_vring_addr addr = { .index = index,
-            .desc_user_addr = (uintptr_t) &vring->desc,
-            .avail_user_addr = (uintptr_t) &vring->avail,
-            .used_user_addr = (uintptr_t) &vring->used,
+            .desc_user_addr = (uintptr_t) vring->desc,
+            .avail_user_addr = (uintptr_t) vhost_vring_avail(vring),
+            .used_user_addr = (uintptr_t) vhost_vring_used(vring),
             .log_guest_addr = (uintptr_t) NULL,
             .flags = 0 };
 
@@ -109,12 +261,12 @@ int set_host_vring(UnSock* client, struct vhost_vring *vring, int index)
 
 // TODO 不属于vring，提取到vhost-user
 int set_host_vring_table(struct vhost_vring* vring_table[], size_t vring_table_num,
-        UnSock* client)
+        UnSock* client, uint64_t features)
 {
     int i = 0;
 
     for (i = 0; i < vring_table_num; i++) {
-        if (set_host_vring(client, vring_table[i], i) != 0) {
+        if (set_host_vring(client, vring_table[i], i, features) != 0) {
             fprintf(stderr, "Unable to init vring %d.\n", i);
             return -1;
         }
@@ -122,229 +274,1421 @@ int set_host_vring_table(struct vhost_vring* vring_table[], size_t vring_table_n
     return 0;
 }
 
-// 通过vring发送数据
-// 取last_avail_idx指向的desc，把数据拷入desc对应的buffer，然后更新last_avail_idx
-int put_vring(VringTable* vring_table, uint32_t v_idx, void* buf, size_t size)
+// 把iov各段拷贝到连续的buf，返回拷贝的字节数
+size_t iov_to_buf(const struct iovec* iov, uint32_t iov_cnt, void* buf, size_t size)
 {
-    struct vring_desc* desc = vring_table->vring[v_idx].desc;
-    struct vring_avail* avail = vring_table->vring[v_idx].avail;
-    unsigned int num = vring_table->vring[v_idx].num;
+    size_t done = 0;
+    uint32_t i;
 
-    uint16_t a_idx = vring_table->vring[v_idx].last_avail_idx;
-    void* dest_buf = 0;
-    struct virtio_net_hdr *hdr = 0;
-    size_t hdr_len = sizeof(struct virtio_net_hdr);
+    for (i = 0; i < iov_cnt && done < size; i++) {
+        size_t n = MIN(iov[i].iov_len, size - done);
+        memcpy((uint8_t*)buf + done, iov[i].iov_base, n);
+        done += n;
+    }
 
-    if (size > desc[a_idx].len) {
-        return -1;
+    return done;
+}
+
+// 从iov的第offset字节开始，拷贝最多size字节到buf
+static size_t _iov_to_buf_at(const struct iovec* iov, uint32_t iov_cnt, size_t offset,
+        void* buf, size_t size)
+{
+    struct iovec first;
+    size_t done;
+    uint32_t i;
+
+    for (i = 0; i < iov_cnt && offset >= iov[i].iov_len; i++) {
+        offset -= iov[i].iov_len;
+    }
+
+    if (i == iov_cnt) {
+        return 0;
+    }
+
+    // the first segment is copied from the middle
+    first.iov_base = (uint8_t*)iov[i].iov_base + offset;
+    first.iov_len = iov[i].iov_len - offset;
+    done = iov_to_buf(&first, 1, buf, size);
+
+    return done + iov_to_buf(iov + i + 1, iov_cnt - i - 1, (uint8_t*)buf + done, size - done);
+}
+
+static inline size_t _iov_size(const struct iovec* iov, uint32_t iov_cnt)
+{
+    size_t size = 0;
+    uint32_t i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        size += iov[i].iov_len;
     }
 
-    // move avail head
-    vring_table->vring[v_idx].last_avail_idx = desc[a_idx].next;
+    return size;
+}
 
-    // map the address
-    // 如果有map_handler，做地址映射
+// 如果有map_handler，做地址映射
+static inline void* _map_addr(VringTable* vring_table, uint64_t addr)
+{
     if (vring_table->map_handler) {
-        dest_buf = (void*)vring_table->map_handler(vring_table->context, desc[a_idx].addr);
+        return (void*)vring_table->map_handler(vring_table->context, addr);
+    }
+
+    return (void*) (uintptr_t) addr;
+}
+
+// 一次映射n个地址，有map_burst_handler时只调用一次
+static inline void _map_addrs(VringTable* vring_table, const uint64_t addr[], uint8_t* result[],
+        uint32_t n)
+{
+    uint32_t i;
+
+    if (vring_table->map_burst_handler) {
+        vring_table->map_burst_handler(vring_table->context, addr, (uintptr_t*) result, n);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        result[i] = _map_addr(vring_table, addr[i]);
+    }
+}
+
+// 包头长度，VIRTIO_NET_F_MRG_RXBUF时多一个num_buffers
+static inline size_t _hdr_len(VringTable* vring_table)
+{
+    return VRING_HAS_FEATURE(vring_table, VIRTIO_NET_F_MRG_RXBUF) ?
+            sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+}
+
+// 写包头，offload字段来自src，num_buffers只在VIRTIO_NET_F_MRG_RXBUF时存在
+static inline void _init_hdr(struct virtio_net_hdr_mrg_rxbuf* hdr, size_t hdr_len,
+        const struct virtio_net_hdr* src, uint16_t num_buffers)
+{
+    hdr->hdr.flags = src->flags;
+    hdr->hdr.gso_type = src->gso_type;
+    hdr->hdr.hdr_len = src->hdr_len;
+    hdr->hdr.gso_size = src->gso_size;
+    hdr->hdr.csum_start = src->csum_start;
+    hdr->hdr.csum_offset = src->csum_offset;
+
+    if (hdr_len == sizeof(struct virtio_net_hdr_mrg_rxbuf)) {
+        hdr->num_buffers = num_buffers;
+    }
+}
+
+// 包头加上iov数据一共total字节，需要几个buffer
+static inline uint32_t _num_bufs(size_t total)
+{
+    return (total + BUFFER_SIZE - 1) / BUFFER_SIZE;
+}
+
+/* 包只占一个ring项时包头里的num_buffers
+ * VIRTIO_NET_F_MRG_RXBUF只定义了接收方向的合并，TX ring的每一项都是一个完整的包，这个字段为0
+ */
+static inline uint16_t _whole_num_buffers(uint32_t v_idx)
+{
+    return VHOST_VRING_IS_TX(v_idx) ? 0 : 1;
+}
+
+/* 包 = pkt->hdr + iov数据，把包从off开始的一段拷入addr指向的buffer，最多BUFFER_SIZE
+ * off为0时先写包头，返回写入的长度
+ */
+static size_t _fill_seg(VringTable* vring_table, uint64_t addr, const VringPacket* pkt,
+        size_t off, size_t total, uint16_t num_buffers)
+{
+    size_t hdr_len = _hdr_len(vring_table);
+    size_t len = MIN(BUFFER_SIZE, total - off);
+    uint8_t* buf = _map_addr(vring_table, addr);
+
+    if (off == 0) {
+        _init_hdr((struct virtio_net_hdr_mrg_rxbuf*) buf, hdr_len, &pkt->hdr.hdr, num_buffers);
+        _iov_to_buf_at(pkt->iov, pkt->iov_cnt, 0, buf + hdr_len, len - hdr_len);
     } else {
-        dest_buf = (void*) (uintptr_t) desc[a_idx].addr;
+        _iov_to_buf_at(pkt->iov, pkt->iov_cnt, off - hdr_len, buf, len);
     }
 
-    // set the header to all 0
-    hdr = dest_buf;
-    hdr->flags = 0;
-    hdr->gso_type = 0;
-    hdr->hdr_len = 0;
-    hdr->gso_size = 0;
-    hdr->csum_start = 0;
-    hdr->csum_offset = 0;
+    return len;
+}
 
-    // We support only single buffer per packet
-    memcpy(dest_buf + hdr_len, buf, size);
-    desc[a_idx].len = hdr_len + size;
-    desc[a_idx].flags = 0;
-    desc[a_idx].next = VRING_IDX_NONE;
+/* 把pkt拷入addr指向的buffer，前面放pkt->hdr
+ * 返回写入的总长度，buffer放不下时返回-1
+ */
+static int _fill_buf(VringTable* vring_table, uint32_t v_idx, uint64_t addr, size_t buf_len,
+        const VringPacket* pkt)
+{
+    size_t total = _hdr_len(vring_table) + _iov_size(pkt->iov, pkt->iov_cnt);
 
-    // add to avail
-    avail->ring[avail->idx % num] = a_idx;
-    avail->idx++;
+    if (total > buf_len) {
+        return -1;
+    }
 
-    sync_shm(dest_buf, size);
-    sync_shm((void*)&(avail), sizeof(struct vring_avail));
+    return _fill_seg(vring_table, addr, pkt, 0, total, _whole_num_buffers(v_idx));
+}
 
-    return 0;
+/* split ring生产者的空闲desc栈：free_ids[0, num_free)
+ * 栈顶是最近回收的desc，它的buffer多半还在cache里
+ * 一次取n个，返回这n个index，不够时不取返回NULL
+ */
+static inline uint16_t* _alloc_desc(Vring* vring, uint32_t n)
+{
+    if (n > vring->num_free) {
+        return NULL;
+    }
+
+    vring->num_free -= n;
+
+    return &vring->free_ids[vring->num_free];
 }
 
-/* 释放一个desc到可用链表中，更新last_avail_idx
- *
- *       | last avail idx
- *       v
- *         next
- *   | desc | --> | desc | --> | desc |
- *      ^
- *      | insert here
+/* 包放不进一个buffer时用间接描述符 (VRING_F_INDIRECT_DESC)：
+ * 从空闲栈取链头和n个desc，间接表放在链头的buffer里，数据依次拷入后面n个buffer。
+ * 这n个desc在主表里用next串在链头后面，只给回收用，对端只看间接表
+ * 返回占用的avail项数
  */
-static int _free_vring(VringTable* vring_table, uint32_t v_idx, uint32_t d_idx)
+static int _put_indirect(VringTable* vring_table, uint32_t v_idx,
+        const VringPacket* pkt, uint16_t a_idx)
 {
-    struct vring_desc* desc = vring_table->vring[v_idx].desc;
-    uint16_t f_idx = vring_table->vring[v_idx].last_avail_idx;
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_desc* desc = vring->desc;
+    size_t total = _hdr_len(vring_table) + _iov_size(pkt->iov, pkt->iov_cnt);
+    size_t off = 0;
+    uint16_t* ids;
+    uint16_t d_idx;
+    struct vring_desc* table;
+    uint32_t i;
+    uint32_t n = _num_bufs(total);
 
-    assert(d_idx < VHOST_VRING_SIZE);
+    // the head and n more descriptors
+    if (n > VRING_IOV_MAX || !(ids = _alloc_desc(vring, n + 1))) {
+        return -1;
+    }
 
-    // return the descriptor back to the free list
-    desc[d_idx].len = BUFFER_SIZE;
-    desc[d_idx].flags |= VIRTIO_DESC_F_WRITE;
-    desc[d_idx].next = f_idx;
-    vring_table->vring[v_idx].last_avail_idx = d_idx;
+    table = _map_addr(vring_table, desc[ids[0]].addr);
+    d_idx = ids[0];
 
-    return 0;
+    for (i = 0; i < n; i++) {
+        size_t len;
+
+        // the members stay linked to the head through the main table
+        desc[d_idx].next = ids[i + 1];
+        d_idx = ids[i + 1];
+
+        len = _fill_seg(vring_table, desc[d_idx].addr, pkt, off, total,
+                _whole_num_buffers(v_idx));
+        off += len;
+
+        table[i].addr = desc[d_idx].addr;
+        table[i].len = len;
+        table[i].flags = (i + 1 < n) ? VIRTIO_DESC_F_NEXT : 0;
+        table[i].next = i + 1;
+
+        desc[d_idx].len = len;
+        desc[d_idx].flags = table[i].flags;
+    }
+
+    desc[ids[0]].len = n * sizeof(struct vring_desc);
+    desc[ids[0]].flags = VIRTIO_DESC_F_INDIRECT;
+
+    // add to avail
+    vring->avail->ring[a_idx % vring->num] = ids[0];
+
+    return 1;
 }
 
-/* 释放指定last_used_idx --> 指定index之间的desc
- * vring.last_used_idx是上次记录的位置，used->idx是当前的位置，然后更新vring.last_used_idx
- * 在poll调用，一次性处理。
+/* 包放不进一个buffer时拆到n个desc (VIRTIO_NET_F_MRG_RXBUF，只用于RX ring)：
+ * 每个desc占一个avail项，第一个buffer包头里的num_buffers为n，对端把这n项合成一个包
+ * 返回占用的avail项数
  */
-int process_used_vring(VringTable* vring_table, uint32_t v_idx)
+static int _put_mrg(VringTable* vring_table, uint32_t v_idx,
+        const VringPacket* pkt, uint16_t a_idx)
 {
-    struct vring_used* used = vring_table->vring[v_idx].used;
-    unsigned int num = vring_table->vring[v_idx].num;
-    uint16_t u_idx = vring_table->vring[v_idx].last_used_idx;
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_desc* desc = vring->desc;
+    size_t total = _hdr_len(vring_table) + _iov_size(pkt->iov, pkt->iov_cnt);
+    size_t off = 0;
+    uint16_t* ids;
+    uint32_t i;
+    uint32_t n = _num_bufs(total);
 
-    for (; u_idx != used->idx; u_idx = (u_idx + 1) % num) {
-        _free_vring(vring_table, v_idx, used->ring[u_idx].id);
+    if (n > VRING_IOV_MAX || !(ids = _alloc_desc(vring, n))) {
+        return -1;
     }
 
-    vring_table->vring[v_idx].last_used_idx = u_idx;
+    for (i = 0; i < n; i++, a_idx++) {
+        uint16_t d_idx = ids[i];
 
-    return 0;
+        desc[d_idx].len = _fill_seg(vring_table, desc[d_idx].addr, pkt, off, total, n);
+        desc[d_idx].flags = 0;
+        off += desc[d_idx].len;
+
+        // add to avail
+        vring->avail->ring[a_idx % vring->num] = d_idx;
+    }
+
+    return n;
 }
 
-// 处理一个描述符
-// 入参：available index
-// available：数据可用，used：数据已处理。
-// 更新索引在process_avail_vring，这里没有处理
-static int _process_desc(VringTable* vring_table, uint32_t v_idx, uint32_t a_idx)
+/* 包放不进一个buffer，又没有间接描述符时：从空闲栈取n个desc用next串成一个链，
+ * 数据依次拷入这n个buffer，链只占一个avail项
+ * 返回占用的avail项数
+ */
+static int _put_chain(VringTable* vring_table, uint32_t v_idx,
+        const VringPacket* pkt, uint16_t a_idx)
 {
-    struct vring_desc* desc = vring_table->vring[v_idx].desc;
-    struct vring_avail* avail = vring_table->vring[v_idx].avail;
-    struct vring_used* used = vring_table->vring[v_idx].used;
-    unsigned int num = vring_table->vring[v_idx].num;
-    uint16_t u_idx = vring_table->vring[v_idx].last_used_idx % num;  // 处理完后更新用的
-    uint16_t d_idx = avail->ring[a_idx];    // 要处理的desc的索引
-    uint32_t i, len = 0;
-    uint8_t buf[ETH_PACKET_SIZE];
-    struct virtio_net_hdr *hdr = 0;
-    size_t hdr_len = sizeof(struct virtio_net_hdr);
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_desc* desc = vring->desc;
+    size_t total = _hdr_len(vring_table) + _iov_size(pkt->iov, pkt->iov_cnt);
+    size_t off = 0;
+    uint16_t* ids;
+    uint32_t i;
+    uint32_t n = _num_bufs(total);
 
-#ifdef DUMP_PACKETS
-    fprintf(stdout, "chunks: ");
-#endif
+    if (n > VRING_IOV_MAX || !(ids = _alloc_desc(vring, n))) {
+        return -1;
+    }
 
-    i = d_idx;
-    for (;;) {
-        /* 拷贝desc链的buffer数据，这里总共不超过ETH_PACKET_SIZE 1518的大小，
-         * 一些分支很可能压根没跑到，client每次都是发一个buffer。
-         */
-        void* cur = 0;
-        uint32_t cur_len = desc[i].len;
-
-        // map the address
-        if (vring_table->map_handler) {
-            cur = (void*)vring_table->map_handler(vring_table->context, desc[i].addr);
-        } else {
-            cur = (void*) (uintptr_t) desc[i].addr;
+    for (i = 0; i < n; i++) {
+        uint16_t d_idx = ids[i];
+
+        desc[d_idx].len = _fill_seg(vring_table, desc[d_idx].addr, pkt, off, total,
+                _whole_num_buffers(v_idx));
+        desc[d_idx].flags = (i + 1 < n) ? VIRTIO_DESC_F_NEXT : 0;
+        desc[d_idx].next = (i + 1 < n) ? ids[i + 1] : 0;
+        off += desc[d_idx].len;
+    }
+
+    // add to avail
+    vring->avail->ring[a_idx % vring->num] = ids[0];
+
+    return 1;
+}
+
+// 取空闲栈顶的desc，把iov各段数据拷入desc对应的buffer
+// desc放到avail ring的a_idx位置，avail->idx由调用者更新，返回占用的avail项数
+static int _put_desc(VringTable* vring_table, uint32_t v_idx,
+        const VringPacket* pkt, uint16_t a_idx)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_desc* desc = vring->desc;
+    uint16_t d_idx;
+    int size;
+
+    if (!vring->num_free) {
+        return -1;
+    }
+
+    d_idx = vring->free_ids[vring->num_free - 1];
+
+    size = _fill_buf(vring_table, v_idx, desc[d_idx].addr, BUFFER_SIZE, pkt);
+    if (size < 0) {
+        // too big for one buffer, a TX ring takes each avail entry as a whole packet
+        if (!VHOST_VRING_IS_TX(v_idx) && VRING_HAS_FEATURE(vring_table, VIRTIO_NET_F_MRG_RXBUF)) {
+            return _put_mrg(vring_table, v_idx, pkt, a_idx);
         }
+        if (VRING_HAS_FEATURE(vring_table, VRING_F_INDIRECT_DESC)) {
+            return _put_indirect(vring_table, v_idx, pkt, a_idx);
+        }
+        return _put_chain(vring_table, v_idx, pkt, a_idx);
+    }
 
-        if (len + cur_len < ETH_PACKET_SIZE) {
-            memcpy(buf + len, cur, cur_len);    // server不退出，client退出再次启动与server通信时，这里异常，似乎与地址对齐有关。
-#ifdef DUMP_PACKETS
-            fprintf(stdout, "%d ", cur_len);
-#endif
-        } else {
+    vring->num_free--;
+
+    desc[d_idx].len = size;
+    desc[d_idx].flags = 0;
+
+    // add to avail
+    vring->avail->ring[a_idx % vring->num] = d_idx;
+
+    return 1;
+}
+
+/* packed ring的生产者：buffer和slot绑定，依次放入last_avail_idx开始的slot
+ * 放不进一个buffer的包占连续n个slot：RX ring在VIRTIO_NET_F_MRG_RXBUF时是n个合并的buffer，
+ * 否则是一个n个desc的链，buffer id为链头的slot
+ * 间接表没有地方放，packed ring不协商VRING_F_INDIRECT_DESC
+ * 第一个desc的flags最后写，对端看到它时整个burst都已可见
+ */
+static int _put_burst_packed(VringTable* vring_table, uint32_t v_idx,
+        VringPacket pkts[], uint32_t count)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc;
+    size_t hdr_len = _hdr_len(vring_table);
+    uint16_t head = vring->last_avail_idx;
+    uint16_t head_flags = 0;
+    uint16_t added = 0;
+    uint32_t i, k;
+
+    for (i = 0; i < count; i++) {
+        size_t total = hdr_len + _iov_size(pkts[i].iov, pkts[i].iov_cnt);
+        size_t off = 0;
+        uint32_t n = _num_bufs(total);
+        int mrg = n > 1 && !VHOST_VRING_IS_TX(v_idx)
+                && VRING_HAS_FEATURE(vring_table, VIRTIO_NET_F_MRG_RXBUF);
+        uint16_t id = vring->last_avail_idx;
+
+        if (n > VRING_IOV_MAX || n > vring->num_free) {
             break;
         }
 
-        len += cur_len;
+        for (k = 0; k < n; k++) {
+            uint16_t slot = vring->last_avail_idx;
+            uint16_t flags = vring->avail_wrap_counter ?
+                    VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
 
-        if (desc[i].flags & VIRTIO_DESC_F_NEXT) {
-            i = desc[i].next;
-        } else {
+            if (mrg) {
+                id = slot;
+                vring->chain_len[slot] = 1;
+            } else if (k + 1 < n) {
+                flags |= VIRTIO_DESC_F_NEXT;
+            }
+
+            desc[slot].len = _fill_seg(vring_table, desc[slot].addr, &pkts[i], off, total,
+                    mrg ? n : _whole_num_buffers(v_idx));
+            desc[slot].id = id;
+            off += desc[slot].len;
+            if (added++ == 0) {
+                head_flags = flags;
+            } else {
+                desc[slot].flags = flags;
+            }
+
+            if (++vring->last_avail_idx == vring->num) {
+                vring->last_avail_idx = 0;
+                vring->avail_wrap_counter ^= 1;
+            }
+            vring->num_free--;
+        }
+
+        if (!mrg) {
+            vring->chain_len[id] = n;
+        }
+    }
+
+    if (added) {
+        vring_store_release(&desc[head].flags, head_flags);
+        vring->num_added += added;
+    }
+
+    return i;
+}
+
+/* 一次放入最多count个包，avail->idx只更新一次，pkts[].hdr作为包头写入
+ * 返回放入的包数，desc不够时后面的包不放入，由调用者处理
+ * 放入后调用一次kick通知对端
+ */
+int put_vring_burst(VringTable* vring_table, uint32_t v_idx, VringPacket pkts[], uint32_t count)
+{
+    struct vring_avail* avail = vring_table->vring[v_idx].avail;
+    uint16_t start = avail->idx;
+    uint16_t a_idx = start;
+    uint32_t i;
+    int n;
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        return _put_burst_packed(vring_table, v_idx, pkts, count);
+    }
+
+    for (i = 0; i < count; i++, a_idx += n) {
+        n = _put_desc(vring_table, v_idx, &pkts[i], a_idx);
+        if (n < 0) {
             break;
         }
     }
 
-    if (!len){
+    if (i) {
+        vring_store_release(&avail->idx, a_idx);
+        vring_table->vring[v_idx].num_added += (uint16_t) (a_idx - start);
+    }
+
+    return i;
+}
+
+// 通过vring发送数据
+int put_vring_iov(VringTable* vring_table, uint32_t v_idx, const struct iovec* iov, uint32_t iov_cnt)
+{
+    VringPacket pkt;
+
+    if (iov_cnt > VRING_IOV_MAX) {
         return -1;
     }
 
-    // add it to the used ring
-    used->ring[u_idx].id = d_idx;
-    used->ring[u_idx].len = len;
+    memset(&pkt.hdr, 0, sizeof(pkt.hdr));
+    memcpy(pkt.iov, iov, iov_cnt * sizeof(struct iovec));
+    pkt.iov_cnt = iov_cnt;
 
-#ifdef DUMP_PACKETS
-    fprintf(stdout, "\n");
-#endif
+    return (put_vring_burst(vring_table, v_idx, &pkt, 1) == 1) ? 0 : -1;
+}
+
+int put_vring(VringTable* vring_table, uint32_t v_idx, void* buf, size_t size)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
 
-    // check the header
-    hdr = (struct virtio_net_hdr *)buf;
+    return put_vring_iov(vring_table, v_idx, &iov, 1);
+}
 
-    if ((hdr->flags != 0) || (hdr->gso_type != 0) || (hdr->hdr_len != 0)
-         || (hdr->gso_size != 0) || (hdr->csum_start != 0)
-         || (hdr->csum_offset != 0)) {
-        fprintf(stderr, "wrong flags\n");
-    }
+/* 回收一个包：链头和用next串在后面的desc (间接描述符的数据buffer)，压回空闲栈
+ * 只读desc的flags和next，len和flags在下次取出时重写
+ */
+static void _free_chain(Vring* vring, uint16_t d_idx)
+{
+    struct vring_desc* desc = vring->desc;
+    uint32_t num = vring->num;
+
+    // num_free bounds a corrupted, looping chain
+    while (d_idx < num && vring->num_free < num) {
+        uint16_t flags = desc[d_idx].flags;
+
+        vring->free_ids[vring->num_free++] = d_idx;
 
-    // consume the packet
-    if (vring_table->avail_handler) {
-        if (vring_table->avail_handler(vring_table->context, buf + hdr_len, len - hdr_len) != 0) {
-            // error handling current packet
-            // TODO: we basically drop it here
+        if (!(flags & (VIRTIO_DESC_F_NEXT | VIRTIO_DESC_F_INDIRECT))) {
+            break;
         }
+        d_idx = desc[d_idx].next;
     }
+}
 
-    return 0;
+static inline int _packed_desc_is_avail(uint16_t flags, uint8_t wrap_counter)
+{
+    int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+    int used = !!(flags & VRING_PACKED_DESC_F_USED);
+
+    return avail == wrap_counter && used != wrap_counter;
 }
 
-/* last_avail_idx是本端记录的上一次索引，avail->idx是virtqueue中的索引
- * 处理这一段数据，并更新used索引
+static inline int _packed_desc_is_used(uint16_t flags, uint8_t wrap_counter)
+{
+    int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+    int used = !!(flags & VRING_PACKED_DESC_F_USED);
+
+    return avail == used && used == wrap_counter;
+}
+
+/* packed ring的回收：从last_used_idx开始，收回对端标记为used的slot
+ * 对端按顺序完成，一个used desc归还它所在slot开始的整个链
  */
-int process_avail_vring(VringTable* vring_table, uint32_t v_idx)
+static int _process_used_packed(VringTable* vring_table, uint32_t v_idx)
 {
-    struct vring_avail* avail = vring_table->vring[v_idx].avail;
-    struct vring_used* used = vring_table->vring[v_idx].used;
-    unsigned int num = vring_table->vring[v_idx].num;
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc;
 
-    uint32_t count = 0;
-    uint16_t a_idx = vring_table->vring[v_idx].last_avail_idx % num;
+    while (vring->num_free < vring->num) {
+        uint16_t slot = vring->last_used_idx;
+        uint16_t n, k;
 
-    // Loop all avail descriptors
-    for (;;) {
-        /* we reached the end of avail */
-        if (vring_table->vring[v_idx].last_avail_idx == avail->idx) {
+        if (!_packed_desc_is_used(vring_load_acquire(&desc[slot].flags),
+                vring->used_wrap_counter)) {
             break;
         }
 
-        _process_desc(vring_table, v_idx, a_idx);
-        a_idx = (a_idx + 1) % num;
-        vring_table->vring[v_idx].last_avail_idx++;
-        vring_table->vring[v_idx].last_used_idx++;
-        count++;
-    }
+        n = MIN(vring->chain_len[slot], vring->num - vring->num_free);
+        for (k = 0; k < n; k++) {
+            // give the slot its full buffer back
+            desc[vring->last_used_idx].len = BUFFER_SIZE;
+            vring->num_free++;
 
-    // 更新used索引
-    used->idx = vring_table->vring[v_idx].last_used_idx;
+            if (++vring->last_used_idx == vring->num) {
+                vring->last_used_idx = 0;
+                vring->used_wrap_counter ^= 1;
+            }
+        }
+    }
 
-    return count;
+    return 0;
 }
 
-// 触发kickfd的写入
-int kick(VringTable* vring_table, uint32_t v_idx)
+/* 释放指定last_used_idx --> 指定index之间的desc
+ * vring.last_used_idx是上次记录的位置，used->idx是当前的位置，然后更新vring.last_used_idx
+ * 在poll调用，一次性处理。
+ */
+int process_used_vring(VringTable* vring_table, uint32_t v_idx)
+{
+    struct vring_used* used = vring_table->vring[v_idx].used;
+    unsigned int num = vring_table->vring[v_idx].num;
+    uint16_t u_idx = vring_table->vring[v_idx].last_used_idx;
+    uint16_t used_idx;
+    uint16_t idx;
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        return _process_used_packed(vring_table, v_idx);
+    }
+
+    used_idx = vring_load_acquire(&used->idx);
+
+    /* used->idx is free running, only the ring access wraps at num.
+     * pushed back to front, the stack hands the descriptors out again in
+     * their previous order: consecutive avail entries keep naming consecutive
+     * descriptors, which the consumer takes in batches (_dequeue_batch)
+     */
+    for (idx = used_idx; idx != u_idx; idx--) {
+        // _free_chain reads the flags of the chain head
+        if (VRING_PREFETCH_DESC && (uint16_t) (idx - u_idx) > VRING_PREFETCH_DESC) {
+            struct vring_desc* desc = vring_table->vring[v_idx].desc;
+            vring_prefetch(&desc[used->ring[(uint16_t) (idx - 1 - VRING_PREFETCH_DESC) % num].id]);
+        }
+        _free_chain(&vring_table->vring[v_idx], used->ring[(uint16_t) (idx - 1) % num].id);
+    }
+
+    vring_table->vring[v_idx].last_used_idx = used_idx;
+
+    return 0;
+}
+
+// 开始取一个包
+static inline void _pkt_start(VringPacket* pkt, uint16_t id)
+{
+    pkt->num_buffers = 1;
+    pkt->buf[0].id = id;
+    pkt->buf[0].num_desc = 0;
+    pkt->buf[0].len = 0;
+    pkt->len = 0;
+    pkt->size = 0;
+    pkt->iov_cnt = 0;
+
+#ifdef DUMP_PACKETS
+    fprintf(stdout, "chunks: ");
+#endif
+}
+
+// 合并的包 (VIRTIO_NET_F_MRG_RXBUF) 接着取下一个buffer
+static inline void _pkt_next_buf(VringPacket* pkt, uint16_t id)
+{
+    VringBuf* buf = &pkt->buf[pkt->num_buffers++];
+
+    buf->id = id;
+    buf->num_desc = 0;
+    buf->len = 0;
+}
+
+// 正在取的buffer
+static inline VringBuf* _pkt_buf(VringPacket* pkt)
+{
+    return &pkt->buf[pkt->num_buffers - 1];
+}
+
+/* 把一个desc的buffer映射后加入pkt的iov，不拷贝数据
+ * 开头的包头可能跨多个desc，拷一份到pkt->hdr
+ */
+static int _pkt_add_seg(VringTable* vring_table, VringPacket* pkt, uint64_t addr, uint32_t len)
+{
+    size_t hdr_len = _hdr_len(vring_table);
+    uint8_t* cur = _map_addr(vring_table, addr);
+
+    if (!cur) {
+        return -1;
+    }
+
+    _pkt_buf(pkt)->len += len;
+
+#ifdef DUMP_PACKETS
+    fprintf(stdout, "%d ", len);
+#endif
+
+    // header bytes not yet seen
+    if (pkt->len < hdr_len) {
+        size_t n = MIN(hdr_len - pkt->len, len);
+        memcpy((uint8_t*)&pkt->hdr + pkt->len, cur, n);
+        pkt->len += n;
+        cur += n;
+        len -= n;
+    }
+
+    if (len) {
+        if (pkt->iov_cnt == VRING_IOV_MAX) {
+            return -1;
+        }
+        pkt->iov[pkt->iov_cnt].iov_base = cur;
+        pkt->iov[pkt->iov_cnt].iov_len = len;
+        pkt->iov_cnt++;
+        pkt->size += len;
+        pkt->len += len;
+    }
+
+    return 0;
+}
+
+/* 间接描述符：addr指向一张有len/16项的desc表，把表里的buffer依次加入pkt
+ * split的表按next串起来，packed的表是顺序的
+ */
+static int _pkt_add_indirect(VringTable* vring_table, VringPacket* pkt,
+        uint64_t addr, uint32_t len, int packed)
+{
+    uint32_t num = len / sizeof(struct vring_desc);
+    void* table = _map_addr(vring_table, addr);
+    uint32_t i = 0;
+    uint32_t n;
+
+    if (!table || !num) {
+        return -1;
+    }
+
+    if (packed) {
+        struct vring_packed_desc* pdesc = (struct vring_packed_desc*) table;
+
+        for (i = 0; i < num; i++) {
+            if (_pkt_add_seg(vring_table, pkt, pdesc[i].addr, pdesc[i].len) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // n bounds a looping chain
+    for (n = 0; n < num; n++) {
+        struct vring_desc* idesc = (struct vring_desc*) table + i;
+
+        if (_pkt_add_seg(vring_table, pkt, idesc->addr, idesc->len) != 0) {
+            return -1;
+        }
+        if (!(idesc->flags & VIRTIO_DESC_F_NEXT)) {
+            return 0;
+        }
+        i = idesc->next;
+        if (i >= num) {
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+/* VIRTIO_NET_F_MRG_RXBUF时第一个buffer的包头给出包占的ring项数，只用于RX ring
+ * 项数不合理的包只取第一项，作为坏包交出
+ */
+static uint16_t _pkt_num_buffers(VringTable* vring_table, uint32_t v_idx, VringPacket* pkt)
+{
+    uint16_t n = pkt->hdr.num_buffers;
+
+    if (VHOST_VRING_IS_TX(v_idx) || !VRING_HAS_FEATURE(vring_table, VIRTIO_NET_F_MRG_RXBUF)
+            || pkt->len < sizeof(struct virtio_net_hdr_mrg_rxbuf)) {
+        return 1;
+    }
+
+    if (n == 0 || n > VRING_IOV_MAX) {
+        pkt->len = 0;
+        return 1;
+    }
+
+    return n;
+}
+
+// 包取完，检查header
+static int _pkt_finish(VringTable* vring_table, VringPacket* pkt)
+{
+    struct virtio_net_hdr *hdr = &pkt->hdr.hdr;
+
+#ifdef DUMP_PACKETS
+    fprintf(stdout, "\n");
+#endif
+
+    if (pkt->len < _hdr_len(vring_table)) {
+        pkt->size = 0;
+        pkt->iov_cnt = 0;
+        return -1;
+    }
+
+    // check the header, the offloads themselves are left to the receiver (see offload.c)
+    if ((hdr->flags & ~(VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID))
+         || ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+             && hdr->csum_start + hdr->csum_offset + sizeof(uint16_t) > pkt->size)
+         || ((hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_NONE
+             && hdr->gso_size == 0)) {
+        fprintf(stderr, "wrong flags\n");
+    }
+
+    return 0;
+}
+
+/* 把一个描述符链映射后加入pkt的iov，不拷贝数据
+ * 链头的索引是pkt当前buffer的id
+ * available：数据可用，used：数据已处理。
+ * 索引的更新在dequeue_burst/release_burst，这里不处理
+ */
+static int _fetch_desc(VringTable* vring_table, uint32_t v_idx, VringPacket* pkt)
+{
+    struct vring_desc* desc = vring_table->vring[v_idx].desc;
+    unsigned int num = vring_table->vring[v_idx].num;
+    VringBuf* buf = _pkt_buf(pkt);
+    uint32_t i = buf->id;
+
+    // num bounds a looping chain, zero-length descriptors add no segment to stop it
+    while (buf->num_desc < num) {
+        if (i >= num) {
+            return -1;
+        }
+
+        // an indirect descriptor carries the whole buffer
+        if (desc[i].flags & VIRTIO_DESC_F_INDIRECT) {
+            buf->num_desc++;
+            return _pkt_add_indirect(vring_table, pkt, desc[i].addr, desc[i].len, 0);
+        }
+
+        if (_pkt_add_seg(vring_table, pkt, desc[i].addr, desc[i].len) != 0) {
+            return -1;
+        }
+        buf->num_desc++;
+
+        if (!(desc[i].flags & VIRTIO_DESC_F_NEXT)) {
+            return 0;
+        }
+        i = desc[i].next;
+    }
+
+    return -1;
+}
+
+/* packed ring：取last_avail_idx开始的一个链，加入pkt当前的buffer
+ * 链的desc在ring里是连续的，buffer id在链的最后一个desc
+ * 出错时也要走完整个链，链占的slot要一起归还
+ */
+static int _fetch_desc_packed(VringTable* vring_table, uint32_t v_idx, VringPacket* pkt)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc;
+    VringBuf* buf = _pkt_buf(pkt);
+    int broken = 0;
+
+    for (;;) {
+        uint16_t slot = vring->last_avail_idx;
+        uint16_t flags = desc[slot].flags;
+
+        if (!broken) {
+            if (flags & VIRTIO_DESC_F_INDIRECT) {
+                broken = _pkt_add_indirect(vring_table, pkt,
+                        desc[slot].addr, desc[slot].len, 1) != 0;
+            } else {
+                broken = _pkt_add_seg(vring_table, pkt,
+                        desc[slot].addr, desc[slot].len) != 0;
+            }
+        }
+        buf->id = desc[slot].id;
+        buf->num_desc++;
+
+        if (++vring->last_avail_idx == vring->num) {
+            vring->last_avail_idx = 0;
+            vring->avail_wrap_counter ^= 1;
+        }
+
+        if (!(flags & VIRTIO_DESC_F_NEXT) || buf->num_desc == vring->num) {
+            break;
+        }
+    }
+
+    return broken ? -1 : 0;
+}
+
+/* dequeue_burst的流水线：处理a_idx的包时，预取后面第VRING_PREFETCH_DESC个包的desc，
+ * 和第VRING_PREFETCH_DATA个包的buffer，它的desc在前几轮已经预取了。
+ * avail_idx之前的项才有效，只预取链头
+ */
+static inline void _prefetch_avail(VringTable* vring_table, uint32_t v_idx,
+        uint16_t a_idx, uint16_t avail_idx)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_avail* avail = vring->avail;
+    unsigned int num = vring->num;
+    uint16_t pending = avail_idx - a_idx;
+
+    if (VRING_PREFETCH_DESC && pending > VRING_PREFETCH_DESC) {
+        vring_prefetch(&vring->desc[avail->ring[(uint16_t) (a_idx + VRING_PREFETCH_DESC) % num]]);
+    }
+
+    if (VRING_PREFETCH_DATA && pending > VRING_PREFETCH_DATA) {
+        uint16_t d_idx = avail->ring[(uint16_t) (a_idx + VRING_PREFETCH_DATA) % num];
+
+        if (d_idx < num) {
+            vring_prefetch(_map_addr(vring_table, vring->desc[d_idx].addr));
+        }
+    }
+}
+
+/* packed ring的desc是顺序读的，只预取last_avail_idx后面第VRING_PREFETCH_DATA个slot的buffer
+ * 和split的avail_idx一样，先看flags，对端已经发布的slot才映射它的地址
+ */
+static inline void _prefetch_avail_packed(VringTable* vring_table, uint32_t v_idx)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc;
+    uint32_t slot = vring->last_avail_idx + VRING_PREFETCH_DATA;
+    uint8_t wrap_counter = vring->avail_wrap_counter;
+
+    if (!VRING_PREFETCH_DATA) {
+        return;
+    }
+
+    // the slot is on the next lap of the ring
+    if (slot >= vring->num) {
+        slot -= vring->num;
+        wrap_counter ^= 1;
+    }
+
+    if (slot < vring->num
+            && _packed_desc_is_avail(vring_load_acquire(&desc[slot].flags), wrap_counter)) {
+        vring_prefetch(_map_addr(vring_table, desc[slot].addr));
+    }
+}
+
+/* 批处理的包：一个desc，包头没有offload (flags和gso_type为0)，
+ * RX ring在VIRTIO_NET_F_MRG_RXBUF时num_buffers为1，这样的包头不用再逐个字段检查
+ * 一起映射，映射后的buffer放到bufs[]，返回0
+ */
+static int _batch_map(VringTable* vring_table, uint32_t v_idx, const uint64_t addr[],
+        const uint32_t len[], uint8_t* bufs[])
+{
+    size_t hdr_len = _hdr_len(vring_table);
+    int merged = !VHOST_VRING_IS_TX(v_idx) && hdr_len == sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    uint32_t k;
+
+    _map_addrs(vring_table, addr, bufs, VRING_BATCH);
+
+    for (k = 0; k < VRING_BATCH; k++) {
+        const struct virtio_net_hdr_mrg_rxbuf* hdr =
+                (const struct virtio_net_hdr_mrg_rxbuf*) bufs[k];
+
+        if (len[k] < hdr_len || !hdr || hdr->hdr.flags || hdr->hdr.gso_type
+                || (merged && hdr->num_buffers != 1)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// 批处理的包：已经由_batch_map检查过，直接填pkt
+static inline void _batch_pkt(VringTable* vring_table, VringPacket* pkt,
+        uint16_t id, uint8_t* buf, uint32_t len)
+{
+    size_t hdr_len = _hdr_len(vring_table);
+
+    pkt->num_buffers = 1;
+    pkt->buf[0].id = id;
+    pkt->buf[0].num_desc = 1;
+    pkt->buf[0].len = len;
+    pkt->len = len;
+    pkt->size = len - hdr_len;
+    pkt->iov_cnt = pkt->size ? 1 : 0;
+    pkt->iov[0].iov_base = buf + hdr_len;
+    pkt->iov[0].iov_len = pkt->size;
+    memcpy(&pkt->hdr, buf, hdr_len);
+
+#ifdef DUMP_PACKETS
+    fprintf(stdout, "chunks: %d \n", len);
+#endif
+}
+
+/* split ring的批处理：a_idx开始的VRING_BATCH个avail项是连续的desc，且都不是链
+ * 就一起检查flags和包头，一起取出。条件不满足时什么都不做，返回-1，由逐个取的路径处理
+ */
+static int _dequeue_batch(VringTable* vring_table, uint32_t v_idx,
+        VringPacket pkts[], uint16_t a_idx)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    unsigned int num = vring->num;
+    const uint16_t* ids = &vring->avail->ring[a_idx % num];
+    struct vring_desc* desc;
+    uint64_t addr[VRING_BATCH];
+    uint32_t len[VRING_BATCH];
+    uint8_t* bufs[VRING_BATCH];
+    uint32_t k;
+
+    // the entries mustn't wrap, and name ids[0], ids[0] + 1, ...
+    if (a_idx % num + VRING_BATCH > num || ids[0] + VRING_BATCH > num) {
+        return -1;
+    }
+    for (k = 1; k < VRING_BATCH; k++) {
+        if (ids[k] != ids[0] + k) {
+            return -1;
+        }
+    }
+
+    desc = &vring->desc[ids[0]];
+    if (!vring_batch_flags(desc, offsetof(struct vring_desc, flags),
+            VIRTIO_DESC_F_NEXT | VIRTIO_DESC_F_INDIRECT, 0)) {
+        return -1;
+    }
+
+    for (k = 0; k < VRING_BATCH; k++) {
+        addr[k] = desc[k].addr;
+        len[k] = desc[k].len;
+    }
+    if (_batch_map(vring_table, v_idx, addr, len, bufs) != 0) {
+        return -1;
+    }
+
+    for (k = 0; k < VRING_BATCH; k++) {
+        _batch_pkt(vring_table, &pkts[k], ids[0] + k, bufs[k], len[k]);
+    }
+
+    return 0;
+}
+
+/* packed ring的批处理：last_avail_idx开始的VRING_BATCH个slot不跨ring末尾，
+ * 全部AVAIL且不是链时一起取出，否则返回-1
+ */
+static int _dequeue_batch_packed(VringTable* vring_table, uint32_t v_idx, VringPacket pkts[])
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    uint16_t slot = vring->last_avail_idx;
+    struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc + slot;
+    uint16_t avail = vring->avail_wrap_counter ?
+            VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+    uint64_t addr[VRING_BATCH];
+    uint32_t len[VRING_BATCH];
+    uint8_t* bufs[VRING_BATCH];
+    uint32_t k;
+
+    if (slot + VRING_BATCH > vring->num) {
+        return -1;
+    }
+
+    if (!vring_batch_flags(desc, offsetof(struct vring_packed_desc, flags),
+            VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED
+                | VIRTIO_DESC_F_NEXT | VIRTIO_DESC_F_INDIRECT, avail)) {
+        return -1;
+    }
+    // the flags were read first
+    atomic_thread_fence(memory_order_acquire);
+
+    for (k = 0; k < VRING_BATCH; k++) {
+        addr[k] = desc[k].addr;
+        len[k] = desc[k].len;
+    }
+    if (_batch_map(vring_table, v_idx, addr, len, bufs) != 0) {
+        return -1;
+    }
+
+    for (k = 0; k < VRING_BATCH; k++) {
+        _batch_pkt(vring_table, &pkts[k], desc[k].id, bufs[k], len[k]);
+    }
+
+    vring->last_avail_idx += VRING_BATCH;
+    if (vring->last_avail_idx == vring->num) {
+        vring->last_avail_idx = 0;
+        vring->avail_wrap_counter ^= 1;
+    }
+
+    return 0;
+}
+
+// 坏包交出去时是空的，它的buffer仍然要归还
+static inline void _pkt_drop(VringPacket* pkt)
+{
+    pkt->size = 0;
+    pkt->iov_cnt = 0;
+}
+
+/* VRING_F_EVENT_IDX，消费者取空ring后在device event里写下一个要处理的slot，
+ * 生产者越过它时才kick。返回1表示写了新的event，需要再检查一次ring
+ */
+static int _packed_enable_event(VringTable* vring_table, uint32_t v_idx)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_packed_desc_event* event = (struct vring_packed_desc_event*) vring->used;
+    uint16_t off_wrap = vring->last_avail_idx
+            | (vring->avail_wrap_counter << VRING_PACKED_WRAP_COUNTER_BIT);
+
+    if (!VRING_HAS_FEATURE(vring_table, VRING_F_EVENT_IDX) || vring->notify_off) {
+        return 0;
+    }
+
+    if (event->off_wrap == off_wrap && event->flags == VRING_PACKED_EVENT_FLAG_DESC) {
+        return 0;
+    }
+
+    event->off_wrap = off_wrap;
+    vring_store_release(&event->flags, VRING_PACKED_EVENT_FLAG_DESC);
+    // the event must be visible before the ring is checked again
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return 1;
+}
+
+/* packed ring的消费者：从last_avail_idx开始取AVAIL的slot
+ * 合并的包 (VIRTIO_NET_F_MRG_RXBUF) 的buffer在ring里是连续的
+ */
+static int _dequeue_burst_packed(VringTable* vring_table, uint32_t v_idx,
+        VringPacket pkts[], uint32_t max)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc;
+    uint32_t count;
+
+    for (count = 0; count < max; count++) {
+        VringPacket* pkt = &pkts[count];
+        uint16_t slot = vring->last_avail_idx;
+        uint16_t start = slot;
+        uint8_t wrap_counter = vring->avail_wrap_counter;
+        uint16_t flags = vring_load_acquire(&desc[slot].flags);
+        int broken;
+        uint16_t n, k;
+
+        if (max - count >= VRING_BATCH && _dequeue_batch_packed(vring_table, v_idx, pkt) == 0) {
+            count += VRING_BATCH - 1;
+            continue;
+        }
+
+        if (!_packed_desc_is_avail(flags, vring->avail_wrap_counter)) {
+            // drained, ask for a kick at this slot and look once more
+            if (!_packed_enable_event(vring_table, v_idx)) {
+                break;
+            }
+            flags = vring_load_acquire(&desc[slot].flags);
+            if (!_packed_desc_is_avail(flags, vring->avail_wrap_counter)) {
+                break;
+            }
+        }
+
+        _prefetch_avail_packed(vring_table, v_idx);
+
+        _pkt_start(pkt, desc[slot].id);
+        broken = _fetch_desc_packed(vring_table, v_idx, pkt);
+        n = _pkt_num_buffers(vring_table, v_idx, pkt);
+
+        for (k = 1; k < n; k++) {
+            slot = vring->last_avail_idx;
+            if (!_packed_desc_is_avail(vring_load_acquire(&desc[slot].flags),
+                    vring->avail_wrap_counter)) {
+                break;
+            }
+            _pkt_next_buf(pkt, desc[slot].id);
+            broken |= _fetch_desc_packed(vring_table, v_idx, pkt);
+        }
+
+        // the rest of a merged packet is published along with its head, wait for it
+        if (k < n) {
+            vring->last_avail_idx = start;
+            vring->avail_wrap_counter = wrap_counter;
+            break;
+        }
+
+        if (_pkt_finish(vring_table, pkt) != 0 || broken) {
+            _pkt_drop(pkt);
+        }
+    }
+
+    return count;
+}
+
+/* 从avail ring一次取出最多max个包，avail->idx只读一次
+ * 返回取到的包数，取到的包处理完后必须用release_burst归还
+ */
+int dequeue_burst(VringTable* vring_table, uint32_t v_idx, VringPacket pkts[], uint32_t max)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_avail* avail = vring->avail;
+    struct vring_used* used = vring->used;
+    unsigned int num = vring->num;
+    uint16_t avail_idx;
+    uint16_t a_idx = vring->last_avail_idx;
+    uint16_t n = 1;
+    uint16_t k;
+    uint32_t count;
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        return _dequeue_burst_packed(vring_table, v_idx, pkts, max);
+    }
+
+    avail_idx = vring_load_acquire(&avail->idx);
+
+    // prime the pipeline with the packets the loop below never prefetches
+    for (k = 0; k < VRING_PREFETCH_DESC && (uint16_t) (avail_idx - a_idx) > k; k++) {
+        vring_prefetch(&vring->desc[avail->ring[(uint16_t) (a_idx + k) % num]]);
+    }
+
+    for (count = 0; count < max; count++, a_idx += n) {
+        VringPacket* pkt = &pkts[count];
+        int broken;
+
+        if (a_idx == avail_idx) {
+            /* drained, with VRING_F_EVENT_IDX ask for a kick at a_idx and
+             * look once more, the producer may have missed the new event
+             */
+            if (!VRING_HAS_FEATURE(vring_table, VRING_F_EVENT_IDX)) {
+                break;
+            }
+            // polled, keep the event behind the producer (see vring_set_notify)
+            if (vring->notify_off) {
+                *vring_avail_event(used, num) = a_idx - 1;
+                break;
+            }
+            if (*vring_avail_event(used, num) == a_idx) {
+                break;
+            }
+            *vring_avail_event(used, num) = a_idx;
+            atomic_thread_fence(memory_order_seq_cst);
+            avail_idx = vring_load_acquire(&avail->idx);
+            if (a_idx == avail_idx) {
+                break;
+            }
+        }
+
+        if ((uint16_t) (avail_idx - a_idx) >= VRING_BATCH && max - count >= VRING_BATCH
+                && _dequeue_batch(vring_table, v_idx, pkt, a_idx) == 0) {
+            for (k = 0; k < VRING_BATCH; k++) {
+                _prefetch_avail(vring_table, v_idx, a_idx + k, avail_idx);
+            }
+            count += VRING_BATCH - 1;
+            n = VRING_BATCH;
+            continue;
+        }
+
+        _prefetch_avail(vring_table, v_idx, a_idx, avail_idx);
+
+        _pkt_start(pkt, avail->ring[a_idx % num]);
+        broken = _fetch_desc(vring_table, v_idx, pkt);
+        n = _pkt_num_buffers(vring_table, v_idx, pkt);
+
+        // the rest of a merged packet is published along with its head, wait for it
+        if ((uint16_t) (avail_idx - a_idx) < n) {
+            break;
+        }
+
+        for (k = 1; k < n; k++) {
+            _pkt_next_buf(pkt, avail->ring[(uint16_t) (a_idx + k) % num]);
+            broken |= _fetch_desc(vring_table, v_idx, pkt);
+        }
+
+        // a broken chain is handed out empty, it still has to be released
+        if (_pkt_finish(vring_table, pkt) != 0 || broken) {
+            _pkt_drop(pkt);
+        }
+    }
+
+    vring->last_avail_idx = a_idx;
+
+    return count;
+}
+
+/* packed ring：每个buffer写一个used desc，跳过链占用的slot
+ * 和生产者一样，第一个desc的flags最后写
+ */
+static int _release_burst_packed(VringTable* vring_table, uint32_t v_idx,
+        VringPacket pkts[], uint32_t count)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc;
+    uint16_t head = vring->last_used_idx;
+    uint16_t head_flags = 0;
+    uint32_t written = 0;
+    uint32_t i, k;
+
+    for (i = 0; i < count; i++) {
+        for (k = 0; k < pkts[i].num_buffers; k++) {
+            VringBuf* buf = &pkts[i].buf[k];
+            uint16_t slot = vring->last_used_idx;
+            uint16_t flags = vring->used_wrap_counter ?
+                    (VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED) : 0;
+
+            desc[slot].id = buf->id;
+            desc[slot].len = buf->len;
+            if (written++ == 0) {
+                head_flags = flags;
+            } else {
+                desc[slot].flags = flags;
+            }
+
+            vring->last_used_idx += buf->num_desc;
+            if (vring->last_used_idx >= vring->num) {
+                vring->last_used_idx -= vring->num;
+                vring->used_wrap_counter ^= 1;
+            }
+        }
+    }
+
+    if (written) {
+        vring_store_release(&desc[head].flags, head_flags);
+    }
+
+    return 0;
+}
+
+/* 把dequeue_burst取出的包写入used ring，used->idx只更新一次
+ */
+int release_burst(VringTable* vring_table, uint32_t v_idx, VringPacket pkts[], uint32_t count)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    struct vring_used* used = vring->used;
+    unsigned int num = vring->num;
+    uint16_t u_idx = vring->last_used_idx;
+    uint32_t i, k;
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        return _release_burst_packed(vring_table, v_idx, pkts, count);
+    }
+
+    // a merged packet gives back each of its buffers
+    for (i = 0; i < count; i++) {
+        for (k = 0; k < pkts[i].num_buffers; k++, u_idx++) {
+            used->ring[u_idx % num].id = pkts[i].buf[k].id;
+            used->ring[u_idx % num].len = pkts[i].buf[k].len;
+        }
+    }
+
+    vring->last_used_idx = u_idx;
+
+    // 更新used索引
+    vring_store_release(&used->idx, u_idx);
+
+    return 0;
+}
+
+/* last_avail_idx是本端记录的上一次索引，avail->idx是virtqueue中的索引
+ * 按burst处理这一段数据，并更新used索引
+ * avail_handler需要连续的buffer，单段的包直接交出，多段的包才拷贝
+ */
+int process_avail_vring(VringTable* vring_table, uint32_t v_idx)
+{
+    VringPacket pkts[VRING_BURST_MAX];
+    uint8_t buf[VRING_FRAME_MAX];
+    uint32_t count = 0;
+    uint32_t i, n;
+
+    // Loop all avail descriptors
+    while ((n = dequeue_burst(vring_table, v_idx, pkts, VRING_BURST_MAX)) > 0) {
+        // consume the packets
+        for (i = 0; vring_table->avail_handler && i < n; i++) {
+            VringPacket* pkt = &pkts[i];
+            void* data = buf;
+
+            if (!pkt->size || pkt->size > VRING_FRAME_MAX) {
+                continue;
+            }
+
+            if (pkt->iov_cnt == 1) {
+                data = pkt->iov[0].iov_base;
+            } else {
+                iov_to_buf(pkt->iov, pkt->iov_cnt, buf, sizeof(buf));
+            }
+
+            if (vring_table->avail_handler(vring_table->context, data, pkt->size) != 0) {
+                // error handling current packet
+                // TODO: we basically drop it here
+            }
+        }
+
+        release_burst(vring_table, v_idx, pkts, n);
+        count += n;
+    }
+
+    return count;
+}
+
+/* 消费者打开/关闭kick，轮询ring的一方不需要对端kick
+ * 打开时返回1表示ring里已经有包，调用者要再取一次，这些包不会再有kick
+ */
+int vring_set_notify(VringTable* vring_table, uint32_t v_idx, int enable)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+
+    vring->notify_off = !enable;
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        struct vring_packed_desc* desc = (struct vring_packed_desc*) vring->desc;
+        struct vring_packed_desc_event* event = (struct vring_packed_desc_event*) vring->used;
+
+        if (!enable) {
+            vring_store_release(&event->flags, VRING_PACKED_EVENT_FLAG_DISABLE);
+            return 0;
+        }
+        if (VRING_HAS_FEATURE(vring_table, VRING_F_EVENT_IDX)) {
+            _packed_enable_event(vring_table, v_idx);
+        } else {
+            vring_store_release(&event->flags, VRING_PACKED_EVENT_FLAG_ENABLE);
+            atomic_thread_fence(memory_order_seq_cst);
+        }
+
+        return _packed_desc_is_avail(vring_load_acquire(&desc[vring->last_avail_idx].flags),
+                vring->avail_wrap_counter);
+    }
+
+    /* VRING_F_EVENT_IDX时生产者只看avail_event：放到last_avail_idx之前，
+     * 生产者要再多放64K个buffer才会越过它，消费者每次取空时再往前移
+     */
+    if (!enable) {
+        if (VRING_HAS_FEATURE(vring_table, VRING_F_EVENT_IDX)) {
+            *vring_avail_event(vring->used, vring->num) = vring->last_avail_idx - 1;
+        } else {
+            vring_store_release(&vring->used->flags, VRING_F_NO_NOTIFY);
+        }
+        return 0;
+    }
+    if (VRING_HAS_FEATURE(vring_table, VRING_F_EVENT_IDX)) {
+        *vring_avail_event(vring->used, vring->num) = vring->last_avail_idx;
+    }
+    vring_store_release(&vring->used->flags, 0);
+    // the flag must be visible before the ring is checked again
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return vring_load_acquire(&vring->avail->idx) != vring->last_avail_idx;
+}
+
+/* 上次kick之后发布了num_added个buffer，判断对端是否要求通知
+ * 没有VRING_F_EVENT_IDX时看VRING_F_NO_NOTIFY，有时只看avail_event
+ */
+static int _need_kick(VringTable* vring_table, uint32_t v_idx)
+{
+    Vring* vring = &vring_table->vring[v_idx];
+    uint16_t new_idx, old_idx, event_idx;
+
+    if (!vring->num_added) {
+        return 0;
+    }
+
+    // the published index must be visible before the peer's event is read
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (VRING_HAS_FEATURE(vring_table, VIRTIO_F_RING_PACKED)) {
+        struct vring_packed_desc_event* event = (struct vring_packed_desc_event*) vring->used;
+        uint16_t flags = vring_load_acquire(&event->flags);
+        uint16_t off_wrap = event->off_wrap;
+
+        if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+            return 0;
+        }
+        if (flags != VRING_PACKED_EVENT_FLAG_DESC
+                || !VRING_HAS_FEATURE(vring_table, VRING_F_EVENT_IDX)) {
+            return 1;
+        }
+
+        new_idx = vring->last_avail_idx;
+        old_idx = new_idx - vring->num_added;
+        event_idx = off_wrap & ~(1 << VRING_PACKED_WRAP_COUNTER_BIT);
+        // the event is on the previous lap of the ring
+        if ((off_wrap >> VRING_PACKED_WRAP_COUNTER_BIT) != vring->avail_wrap_counter) {
+            event_idx -= vring->num;
+        }
+
+        return vring_need_event(event_idx, new_idx, old_idx);
+    }
+
+    if (!VRING_HAS_FEATURE(vring_table, VRING_F_EVENT_IDX)) {
+        return !(vring_load_acquire(&vring->used->flags) & VRING_F_NO_NOTIFY);
+    }
+
+    new_idx = vring->avail->idx;
+    old_idx = new_idx - vring->num_added;
+    event_idx = vring_load_acquire(vring_avail_event(vring->used, vring->num));
+
+    return vring_need_event(event_idx, new_idx, old_idx);
+}
+
+// 触发kickfd的写入，对端不需要通知时跳过
+int kick(VringTable* vring_table, uint32_t v_idx)
 {
     uint64_t kick_it = 1;
     int kickfd = vring_table->vring[v_idx].kickfd;
+    int need_kick = _need_kick(vring_table, v_idx);
+
+    vring_table->vring[v_idx].num_added = 0;
+    if (!need_kick) {
+        return 0;
+    }
+
+    // queued with the other notifications, see notify_fd_list
+    if (vring_table->kick_handler
+            && vring_table->kick_handler(vring_table->context, v_idx) == 0) {
+        return 0;
+    }
 
     write(kickfd, &kick_it, sizeof(kick_it));
-    fsync(kickfd);
 
     return 0;
 }
@@ -0,0 +1,117 @@
+/*
+ * vring_simd.c
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <string.h>
+
+#include "vring_simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(VRING_NO_SIMD)
+#define VRING_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define VRING_DESC_SIZE     16
+
+typedef int (*batch_flags_t)(const void* desc, size_t off, uint16_t mask, uint16_t expect);
+
+static int _batch_flags_scalar(const void* desc, size_t off, uint16_t mask, uint16_t expect)
+{
+    const uint8_t* p = (const uint8_t*) desc + off;
+    uint32_t k;
+
+    for (k = 0; k < VRING_BATCH; k++, p += VRING_DESC_SIZE) {
+        uint16_t flags;
+
+        memcpy(&flags, p, sizeof(flags));
+        if ((flags & mask) != expect) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+#ifdef VRING_SIMD_X86
+
+/* 一个desc是8个16位lane，flags在lane off/2，其它lane的mask和expect为0
+ * 这样整个向量比较相等就是所有flags都符合
+ */
+__attribute__((target("sse4.2")))
+static inline __m128i _lane_sse(size_t off, uint16_t v)
+{
+    return _mm_set_epi16(off == 14 ? v : 0, off == 12 ? v : 0, 0, 0, 0, 0, 0, 0);
+}
+
+__attribute__((target("sse4.2")))
+static int _batch_flags_sse(const void* desc, size_t off, uint16_t mask, uint16_t expect)
+{
+    const __m128i* p = (const __m128i*) desc;
+    __m128i m = _lane_sse(off, mask);
+    __m128i e = _lane_sse(off, expect);
+    __m128i eq = _mm_set1_epi8(-1);
+    uint32_t k;
+
+    for (k = 0; k < VRING_BATCH; k++) {
+        __m128i d = _mm_and_si128(_mm_loadu_si128(p + k), m);
+        eq = _mm_and_si128(eq, _mm_cmpeq_epi16(d, e));
+    }
+
+    return _mm_test_all_ones(eq);
+}
+
+// 两个desc一个256位向量
+__attribute__((target("avx2")))
+static int _batch_flags_avx2(const void* desc, size_t off, uint16_t mask, uint16_t expect)
+{
+    const __m256i* p = (const __m256i*) desc;
+    __m256i m = _mm256_broadcastsi128_si256(_lane_sse(off, mask));
+    __m256i e = _mm256_broadcastsi128_si256(_lane_sse(off, expect));
+    __m256i eq = _mm256_set1_epi8(-1);
+    uint32_t k;
+
+    for (k = 0; k < VRING_BATCH / 2; k++) {
+        __m256i d = _mm256_and_si256(_mm256_loadu_si256(p + k), m);
+        eq = _mm256_and_si256(eq, _mm256_cmpeq_epi16(d, e));
+    }
+
+    return _mm256_movemask_epi8(eq) == -1;
+}
+
+#endif
+
+static batch_flags_t _batch_flags = _batch_flags_scalar;
+static const char* _simd_name = "scalar";
+
+// 程序启动时选一次，之后只读
+__attribute__((constructor))
+static void _vring_simd_init(void)
+{
+#ifdef VRING_SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        _batch_flags = _batch_flags_avx2;
+        _simd_name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        _batch_flags = _batch_flags_sse;
+        _simd_name = "sse4.2";
+    }
+#endif
+}
+
+int vring_batch_flags(const void* desc, size_t off, uint16_t mask, uint16_t expect)
+{
+    return _batch_flags(desc, off, mask, expect);
+}
+
+const char* vring_simd_name(void)
+{
+    return _simd_name;
+}
@@ -0,0 +1,224 @@
+/*
+ * worker.c
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+Worker* new_worker(uint32_t id, int cpu, void* context, worker_handler_t handler)
+{
+    Worker* worker = (Worker*) calloc(1, sizeof(Worker));
+
+    if (!worker) {
+        return NULL;
+    }
+
+    worker->id = id;
+    worker->cpu = cpu;
+    worker->context = context;
+    worker->handler = handler;
+    atomic_init(&worker->running, 0);
+    atomic_init(&worker->epoch, 0);
+    atomic_init(&worker->queue_num, 0);
+
+    worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wakefd = worker->epfd == -1 ? -1 : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wakefd == -1 || worker->epfd == -1 || worker_watch_fd(worker, worker->wakefd) != 0) {
+        perror("new_worker");
+        free_worker(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+// 线程要先stop_worker
+void free_worker(Worker* worker)
+{
+    if (worker->epfd >= 0) {
+        close(worker->epfd);
+    }
+    if (worker->wakefd >= 0) {
+        close(worker->wakefd);
+    }
+    free(worker);
+}
+
+/* kick fd时唤醒睡眠的worker。edge-triggered，eventfd的计数不用读：
+ * 每次write都是一个新的事件，睡眠之前的kick最多让worker空转一轮
+ */
+int worker_watch_fd(Worker* worker, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.fd = fd };
+
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("worker_watch_fd");
+        return -1;
+    }
+
+    return 0;
+}
+
+int worker_unwatch_fd(Worker* worker, int fd)
+{
+    return epoll_ctl(worker->epfd, EPOLL_CTL_DEL, fd, NULL) == -1 ? -1 : 0;
+}
+
+// 让睡眠的worker马上做一轮，没有睡眠时它下次就不睡
+void wake_worker(Worker* worker)
+{
+    uint64_t one = 1;
+
+    // fails only with the counter full, which wakes the worker all the same
+    write(worker->wakefd, &one, sizeof(one));
+}
+
+// 所有queue都在等kick，没有queue时也一样
+static void _worker_sleep(Worker* worker)
+{
+    struct epoll_event events[WORKER_QUEUE_MAX + 1];
+
+    epoll_wait(worker->epfd, events, WORKER_QUEUE_MAX + 1, WORKER_SLEEP_MS);
+}
+
+static void* _worker_loop(void* arg)
+{
+    Worker* worker = (Worker*) arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(worker->cpu, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+            fprintf(stderr, "Worker %u: unable to pin to cpu %d\n", worker->id, worker->cpu);
+        }
+    }
+
+    while (atomic_load(&worker->running)) {
+        uint32_t num = atomic_load(&worker->queue_num);
+        uint32_t i;
+        int idle = 1;
+
+        for (i = 0; i < num; i++) {
+            if (worker->handler(worker->context, atomic_load(&worker->queues[i])) != WORKER_IDLE) {
+                idle = 0;
+            }
+        }
+
+        // the queues dropped before this point are no longer touched
+        atomic_fetch_add(&worker->epoch, 1);
+
+        if (idle) {
+            _worker_sleep(worker);
+        }
+    }
+
+    return NULL;
+}
+
+int start_worker(Worker* worker)
+{
+    int r;
+
+    atomic_store(&worker->running, 1);
+
+    r = pthread_create(&worker->thread, NULL, _worker_loop, worker);
+    if (r != 0) {
+        fprintf(stderr, "Worker %u: pthread_create: %s\n", worker->id, strerror(r));
+        atomic_store(&worker->running, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+// 停止并等待线程退出
+int stop_worker(Worker* worker)
+{
+    if (!atomic_exchange(&worker->running, 0)) {
+        return 0;
+    }
+    wake_worker(worker);
+
+    return pthread_join(worker->thread, NULL) == 0 ? 0 : -1;
+}
+
+// 只由控制线程调用
+int add_worker_queue(Worker* worker, uint32_t queue)
+{
+    uint32_t num = atomic_load(&worker->queue_num);
+
+    if (num == WORKER_QUEUE_MAX) {
+        return -1;
+    }
+
+    atomic_store(&worker->queues[num], queue);
+    atomic_store(&worker->queue_num, num + 1);
+
+    return 0;
+}
+
+/* 只由控制线程调用，最后一个queue移到空出的位置
+ * worker可能还在处理这个queue，交给别的线程之前要先sync_worker
+ */
+int del_worker_queue(Worker* worker, uint32_t queue)
+{
+    uint32_t num = atomic_load(&worker->queue_num);
+    uint32_t i;
+
+    for (i = 0; i < num; i++) {
+        if (atomic_load(&worker->queues[i]) == queue) {
+            atomic_store(&worker->queues[i], atomic_load(&worker->queues[num - 1]));
+            atomic_store(&worker->queue_num, num - 1);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* 等worker做完当前这一轮。之前去掉的queue，或者之前标记为不可处理的queue，
+ * 返回后worker不会再碰
+ */
+void sync_worker(Worker* worker)
+{
+    unsigned int epoch = atomic_load(&worker->epoch);
+
+    // a sleeping worker finishes its round only once it wakes up
+    wake_worker(worker);
+
+    while (atomic_load(&worker->running) && atomic_load(&worker->epoch) == epoch) {
+        sched_yield();
+    }
+}
+
+/* 把queue从from交给to：先去掉，等from做完这一轮，再加到to
+ * 任何时刻最多只有一个线程处理这个queue
+ */
+int move_worker_queue(Worker* from, Worker* to, uint32_t queue)
+{
+    if (atomic_load(&to->queue_num) == WORKER_QUEUE_MAX
+            || del_worker_queue(from, queue) != 0) {
+        return -1;
+    }
+
+    sync_worker(from);
+
+    return add_worker_queue(to, queue);
+}
@@ -25,14 +25,17 @@
 
 #define VHOST_CLIENT_TEST_MESSAGE        (arp_request)
 #define VHOST_CLIENT_TEST_MESSAGE_LEN    (sizeof(arp_request))
-#define VHOST_CLIENT_PAGE_SIZE \
-            ALIGN(sizeof(struct vhost_vring)+BUFFER_SIZE*VHOST_VRING_SIZE, ONEMEG)
+#define VHOST_CLIENT_TX_BURST            (8)    // packets sent per poll
+#define VHOST_CLIENT_PAGE_SIZE(num)     ALIGN(vring_mem_size(num), ONEMEG)
 
 static int _kick_client(struct fd_node* node);
+static int kick_handler(void* context, uint32_t v_idx);
 static int avail_handler_client(void* context, void* buf, size_t size);
 
 
-VhostClient* new_vhost_client(const char* path)
+// vring_num: ring size of the queues, sent to the server with SET_VRING_NUM
+// queue_pairs: RX/TX pairs wanted, the server may offer fewer
+VhostClient* new_vhost_client(const char* path, unsigned int vring_num, uint32_t queue_pairs)
 {
     VhostClient* vhost_client = (VhostClient*) calloc(1, sizeof(VhostClient));
     int idx = 0;
@@ -40,11 +43,14 @@ VhostClient* new_vhost_client(const char* path)
     // create unsock and connect
     vhost_client->unsock = new_unsock(path);
     
-    // 创建共享内存regions，数量与VRING数量相同
-    vhost_client->page_size = VHOST_CLIENT_PAGE_SIZE;
-    vhost_client->memory.nregions = VHOST_CLIENT_VRING_NUM;
+    vhost_client->queue_pairs = MAX(1, MIN(queue_pairs, VHOST_CLIENT_QUEUE_PAIRS_MAX));
+
+    // 创建共享内存regions，数量与VRING数量相同，大小取决于各自的ring大小
+    vhost_client->memory.nregions = VHOST_VRING_IDX(vhost_client->queue_pairs, 0);
     for (idx = 0; idx < vhost_client->memory.nregions; idx++) {
-        void* shm = create_shm(vhost_client->page_size, idx);
+        size_t page_size = VHOST_CLIENT_PAGE_SIZE(vring_num);
+        // rounded up to the page size the region ends up on
+        void* shm = create_shm(&page_size, idx);
         if (!shm) {
             fprintf(stderr, "Creating shm %d failed\n", idx);
             free(vhost_client->unsock);
@@ -52,23 +58,10 @@ VhostClient* new_vhost_client(const char* path)
             return NULL;
         }
         vhost_client->memory.regions[idx].guest_phys_addr = (uintptr_t) shm;
-        vhost_client->memory.regions[idx].memory_size = vhost_client->page_size;
+        vhost_client->memory.regions[idx].memory_size = page_size;
         vhost_client->memory.regions[idx].userspace_addr = (uintptr_t) shm;
         vhost_client->memory.regions[idx].mmap_offset = 0;
-    }
-
-    // 在memory初始化vring结构，并把指针赋给vring_table_shm，vring_table_shm会作为MEM_TABLE发给对端。
-    /* TODO: here we assume we're putting each vring in a separate
-     * memory region from the memory map.
-     * In reality this probably is not like that
-     */
-    for (idx = 0; idx < VHOST_CLIENT_VRING_NUM; idx++) {
-        struct vhost_vring* vring = new_vring((void*)(uintptr_t)vhost_client->memory.regions[idx].guest_phys_addr);
-        if (!vring) {
-            fprintf(stderr, "Unable to create vring from memory region %d.\n", idx);
-            return NULL;
-        }
-        vhost_client->vring_table_shm[idx] = vring;
+        vhost_client->vring_num[idx] = vring_num;
     }
 
     return vhost_client;
@@ -104,6 +97,64 @@ int init_vhost_client(VhostClient* vhost_client)
     */
     vhost_ioctl(vhost_client->unsock, VHOST_USER_GET_FEATURES, &vhost_client->features);
 
+    // keep what both sides support
+    vhost_client->features &= VHOST_CLIENT_FEATURES;
+    // the packed ring producer writes no indirect tables (_put_burst_packed)
+    if (vhost_client->features & (1ULL << VIRTIO_F_RING_PACKED)) {
+        vhost_client->features &= ~(1ULL << VRING_F_INDIRECT_DESC);
+    }
+
+    /* VHOST_USER_GET_PROTOCOL_FEATURES (15)
+       Get the protocol features bitmask, only if the slave has
+       VHOST_USER_F_PROTOCOL_FEATURES. Slave payload: u64
+    */
+    if (vhost_client->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        vhost_ioctl(vhost_client->unsock, VHOST_USER_GET_PROTOCOL_FEATURES,
+                &vhost_client->protocol_features);
+        vhost_client->protocol_features &= VHOST_CLIENT_PROTOCOL_FEATURES;
+        vhost_ioctl(vhost_client->unsock, VHOST_USER_SET_PROTOCOL_FEATURES,
+                &vhost_client->protocol_features);
+    }
+
+    /* VHOST_USER_GET_QUEUE_NUM (17)
+       Query how many queue pairs the slave supports, only with
+       VHOST_USER_PROTOCOL_F_MQ. Slave payload: u64
+    */
+    if ((vhost_client->features & (1ULL << VIRTIO_NET_F_MQ))
+            && (vhost_client->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ))) {
+        uint64_t queue_num = 0;
+
+        vhost_ioctl(vhost_client->unsock, VHOST_USER_GET_QUEUE_NUM, &queue_num);
+        vhost_client->queue_pairs = MAX(1, MIN(vhost_client->queue_pairs, queue_num));
+    } else {
+        vhost_client->features &= ~(1ULL << VIRTIO_NET_F_MQ);
+        vhost_client->queue_pairs = 1;
+    }
+
+    // tell the server
+    vhost_ioctl(vhost_client->unsock, VHOST_USER_SET_FEATURES, &vhost_client->features);
+
+    if (init_vring_table(&vhost_client->vring_table,
+            VHOST_VRING_IDX(vhost_client->queue_pairs, 0)) != 0) {
+        return -1;
+    }
+
+    // 在memory初始化vring结构，并把指针赋给vring_table_shm，vring_table_shm会作为MEM_TABLE发给对端。
+    // vring的布局取决于协商的features (split/packed)
+    /* TODO: here we assume we're putting each vring in a separate
+     * memory region from the memory map.
+     * In reality this probably is not like that
+     */
+    for (idx = 0; idx < vhost_client->vring_table.num_vrings; idx++) {
+        struct vhost_vring* vring = new_vring((void*)(uintptr_t)vhost_client->memory.regions[idx].guest_phys_addr,
+                vhost_client->vring_num[idx], vhost_client->features);
+        if (!vring) {
+            fprintf(stderr, "Unable to create vring from memory region %d.\n", idx);
+            return -1;
+        }
+        vhost_client->vring_table_shm[idx] = vring;
+    }
+
     /* VHOST_USER_SET_MEM_TABLE (5)
        Sets the memory map regions on the slave so it can translate the vring
        addresses. In the ancillary data there is an array of file descriptors
@@ -113,32 +164,56 @@ int init_vhost_client(VhostClient* vhost_client)
     vhost_ioctl(vhost_client->unsock, VHOST_USER_SET_MEM_TABLE, &vhost_client->memory);
 
     // push the vring table info to the server
-    // 2个vring，一个收，一个发
-    if (set_host_vring_table(vhost_client->vring_table_shm, VHOST_CLIENT_VRING_NUM,
-            vhost_client->unsock) != 0) {
+    // 每个queue pair 2个vring，一个收，一个发
+    if (set_host_vring_table(vhost_client->vring_table_shm, vhost_client->vring_table.num_vrings,
+            vhost_client->unsock, vhost_client->features) != 0) {
         // TODO: handle error here
     }
 
+    /* VHOST_USER_SET_VRING_ENABLE (18)
+       With VHOST_USER_F_PROTOCOL_FEATURES the rings start disabled.
+       Master payload: vring state description, num 1 enables the ring
+    */
+    if (vhost_client->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        for (idx = 0; idx < vhost_client->vring_table.num_vrings; idx++) {
+            struct vhost_vring_state enable = { .index = idx, .num = 1 };
+            vhost_ioctl(vhost_client->unsock, VHOST_USER_SET_VRING_ENABLE, &enable);
+        }
+    }
+
     // VringTable initalization
     vhost_client->vring_table.context = (void*) vhost_client;
     vhost_client->vring_table.avail_handler = avail_handler_client;
     vhost_client->vring_table.map_handler = NULL;
+    vhost_client->vring_table.map_burst_handler = NULL;
+    vhost_client->vring_table.kick_handler = kick_handler;
+    vhost_client->vring_table.features = vhost_client->features;
 
-    for (idx = 0; idx < VHOST_CLIENT_VRING_NUM; idx++) {
+    for (idx = 0; idx < vhost_client->vring_table.num_vrings; idx++) {
         vhost_client->vring_table.vring[idx].kickfd = vhost_client->vring_table_shm[idx]->kickfd;
         vhost_client->vring_table.vring[idx].callfd = vhost_client->vring_table_shm[idx]->callfd;
         vhost_client->vring_table.vring[idx].desc = vhost_client->vring_table_shm[idx]->desc;
-        vhost_client->vring_table.vring[idx].avail = &vhost_client->vring_table_shm[idx]->avail;
-        vhost_client->vring_table.vring[idx].used = &vhost_client->vring_table_shm[idx]->used;
-        vhost_client->vring_table.vring[idx].num = VHOST_VRING_SIZE;
+        vhost_client->vring_table.vring[idx].avail = vhost_vring_avail(vhost_client->vring_table_shm[idx]);
+        vhost_client->vring_table.vring[idx].used = vhost_vring_used(vhost_client->vring_table_shm[idx]);
+        vhost_client->vring_table.vring[idx].num = vhost_client->vring_table_shm[idx]->num;
         vhost_client->vring_table.vring[idx].last_avail_idx = 0;
         vhost_client->vring_table.vring[idx].last_used_idx = 0;
+        // same base as sent to the server by set_host_vring
+        if (set_vring_base(&vhost_client->vring_table, idx,
+                VRING_HAS_FEATURE(&vhost_client->vring_table, VIRTIO_F_RING_PACKED)
+                    << VRING_PACKED_WRAP_COUNTER_BIT) != 0) {
+            fprintf(stderr, "Unable to set vring %d base.\n", idx);
+            return -1;
+        }
     }
 
-    // Add handler for RX kickfd
-    add_fd_list(&vhost_client->unsock->fd_list, FD_READ,
-            vhost_client->vring_table.vring[VHOST_CLIENT_VRING_IDX_RX].kickfd,
-            (void*) vhost_client, _kick_client);
+    // Add handler for RX kickfd of every queue pair
+    for (idx = VHOST_CLIENT_VRING_IDX_RX; idx < vhost_client->vring_table.num_vrings;
+            idx += VHOST_CLIENT_VRING_NUM) {
+        add_fd_list(&vhost_client->unsock->fd_list, FD_EVENT,
+                vhost_client->vring_table.vring[idx].kickfd,
+                (void*) vhost_client, _kick_client);
+    }
 
     return 0;
 }
@@ -157,6 +232,7 @@ int end_vhost_client(VhostClient* vhost_client)
     }
 
     close_unsock(vhost_client->unsock);
+    free_vring_table(&vhost_client->vring_table);
 
     //TODO: should this be here?
     free(vhost_client->unsock);
@@ -165,17 +241,31 @@ int end_vhost_client(VhostClient* vhost_client)
     return 0;
 }
 
-static int send_packet(VhostClient* vhost_client, void* p, size_t size)
+// 发送count个相同的包，只更新一次avail索引，只kick一次
+// 返回发出的包数
+static int send_packet(VhostClient* vhost_client, uint32_t qp, void* p, size_t size, uint32_t count)
 {
+    VringPacket pkts[VHOST_CLIENT_TX_BURST];
+    uint32_t tx_idx = VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_TX);
+    uint32_t i;
     int r = 0;
-    uint32_t tx_idx = VHOST_CLIENT_VRING_IDX_TX;
 
-    r = put_vring(&vhost_client->vring_table, tx_idx, p, size);
+    count = MIN(count, VHOST_CLIENT_TX_BURST);
+    for (i = 0; i < count; i++) {
+        memset(&pkts[i].hdr, 0, sizeof(pkts[i].hdr));
+        pkts[i].iov[0].iov_base = p;
+        pkts[i].iov[0].iov_len = size;
+        pkts[i].iov_cnt = 1;
+    }
+
+    r = put_vring_burst(&vhost_client->vring_table, tx_idx, pkts, count);
 
-    if (r != 0)
+    if (r <= 0)
         return -1;
 
-    return kick(&vhost_client->vring_table, tx_idx);
+    kick(&vhost_client->vring_table, tx_idx);
+
+    return r;
 }
 
 static int avail_handler_client(void* context, void* buf, size_t size)
@@ -191,48 +281,64 @@ static int avail_handler_client(void* context, void* buf, size_t size)
 static int _kick_client(struct fd_node* node)
 {
     VhostClient* vhost_client = (VhostClient*) node->context;
+    VringTable* vring_table = &vhost_client->vring_table;
     int kickfd = node->fd;
-    ssize_t r;
-    uint64_t kick_it = 0;
-
-    r = read(kickfd, &kick_it, sizeof(kick_it));
+    uint32_t idx;
 
-    if (r < 0) {
-        perror("recv kick");
-    } else if (r == 0) {
-        fprintf(stdout, "Kick fd closed\n");
-        del_fd_list(&vhost_client->unsock->fd_list, FD_READ, kickfd);
-    } else {
-        int idx = VHOST_CLIENT_VRING_IDX_RX;
+    // FD_EVENT: the FdList has read the counter
 #if 0
-        fprintf(stdout, "Got kick %ld\n", kick_it);
+    fprintf(stdout, "Got kick %ld\n", node->value);
 #endif
 
-        process_avail_vring(&vhost_client->vring_table, idx);
+    // find the RX ring the kick belongs to
+    for (idx = VHOST_CLIENT_VRING_IDX_RX; idx < vring_table->num_vrings;
+            idx += VHOST_CLIENT_VRING_NUM) {
+        if (vring_table->vring[idx].kickfd == kickfd) {
+            process_avail_vring(vring_table, idx);
+            break;
+        }
     }
 
     return 0;
 }
 
-static int poll_client(void* context)
+// kick排进FdList的io_uring，和socket、RX kick一起提交
+static int kick_handler(void* context, uint32_t v_idx)
 {
     VhostClient* vhost_client = (VhostClient*) context;
-    uint32_t tx_idx = VHOST_CLIENT_VRING_IDX_TX;
 
-    LOG("%s: process_used_vring\n", __FUNCTION__);
-    if (process_used_vring(&vhost_client->vring_table, tx_idx) != 0) {
-        fprintf(stderr, "handle_used_vring failed.\n");
-        return -1;
-    }
+    return notify_fd_list(&vhost_client->unsock->fd_list,
+            vhost_client->vring_table.vring[v_idx].kickfd);
+}
 
-    LOG("%s: send_packet\n", __FUNCTION__);
-    if (send_packet(vhost_client, (void*) VHOST_CLIENT_TEST_MESSAGE,
-            VHOST_CLIENT_TEST_MESSAGE_LEN) != 0) {
-        fprintf(stdout, "Send packet failed.\n");
-        return -1;
+static int poll_client(void* context)
+{
+    VhostClient* vhost_client = (VhostClient*) context;
+    uint32_t qp;
+    int total = 0;
+
+    // 每个queue pair各自回收、发送
+    for (qp = 0; qp < vhost_client->queue_pairs; qp++) {
+        uint32_t tx_idx = VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_TX);
+        int sent = 0;
+
+        LOG("%s: process_used_vring\n", __FUNCTION__);
+        if (process_used_vring(&vhost_client->vring_table, tx_idx) != 0) {
+            fprintf(stderr, "handle_used_vring failed.\n");
+            return -1;
+        }
+
+        LOG("%s: send_packet\n", __FUNCTION__);
+        sent = send_packet(vhost_client, qp, (void*) VHOST_CLIENT_TEST_MESSAGE,
+                VHOST_CLIENT_TEST_MESSAGE_LEN, VHOST_CLIENT_TX_BURST);
+        if (sent < 0) {
+            fprintf(stdout, "Send packet failed.\n");
+            return -1;
+        }
+        total += sent;
     }
 
-    update_stat(&vhost_client->stat,1);
+    update_stat(&vhost_client->stat, total);
     print_stat(&vhost_client->stat);
 
     return 0;
@@ -296,10 +402,18 @@ int main(int argc, char* argv[])
     atexit(cleanup);
     init_signals();
 
-    char *path = argc == 2 ? argv[1] : NULL;
+    char *path = argc >= 2 ? argv[1] : NULL;
+    // optional ring size, a power of 2 up to VHOST_VRING_SIZE
+    unsigned int vring_num = argc >= 3 ? strtoul(argv[2], NULL, 0) : VHOST_CLIENT_VRING_SIZE;
+    // optional number of queue pairs, up to VHOST_CLIENT_QUEUE_PAIRS_MAX
+    uint32_t queue_pairs = argc >= 4 ? strtoul(argv[3], NULL, 0) : 1;
 
     /* vhost-user client, can be qemu */
-    vhost_master = new_vhost_client(path);
+    vhost_master = new_vhost_client(path, vring_num, queue_pairs);
+    if (!vhost_master) {
+        return EXIT_FAILURE;
+    }
+
     run_vhost_client(vhost_master);
     free(vhost_master);
 
@@ -22,7 +22,7 @@
 #define ONEMEG                  (1024*1024)
 
 #define ETH_PACKET_SIZE         (1518)
-#define BUFFER_SIZE             (sizeof(struct virtio_net_hdr) + ETH_PACKET_SIZE)
+#define BUFFER_SIZE             (sizeof(struct virtio_net_hdr_mrg_rxbuf) + ETH_PACKET_SIZE)
 #define BUFFER_ALIGNMENT        (8)         // alignment in bytes
 #define VHOST_SOCK_NAME         "vhost.sock"
 
@@ -55,7 +55,8 @@ int vhost_user_recv_fds(int fd, const struct VhostUserMsg *msg, int *fds, size_t
 
 // debug utilities
 void dump_buffer(uint8_t* p, size_t len);
-void dump_vring(struct vring_desc* desc, struct vring_avail* avail,struct vring_used* used);
+void dump_vring(struct vring_desc* desc, struct vring_avail* avail,struct vring_used* used,
+        unsigned int num);
 void dump_vhost_vring(struct vhost_vring* vring);
 
 #endif /* COMMON_H_ */
@@ -14,29 +14,56 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define FD_LIST_SIZE    10
+#include "uring.h"
+
+// initial entries of the fd tables, they grow to the highest fd added
+#define FD_LIST_SIZE    16
+// ready fds one epoll_wait returns, the rest come with the next call
+#define FD_LIST_EVENTS  64
+
+/* -DFD_LIST_URING: fd事件和eventfd的读写都经过io_uring批量提交，
+ * 内核不支持时退回到epoll
+ * FD_LIST_URING_SQPOLL不为0时由内核线程轮询SQ，空闲这么多ms后睡眠，
+ * 这个线程要有空闲的CPU，和client/server挤在一个CPU上反而更慢
+ */
+#define FD_LIST_URING_ENTRIES   256
+#ifndef FD_LIST_URING_SQPOLL
+#define FD_LIST_URING_SQPOLL    0
+#endif
+
+// FD_WRITE并未使用
+typedef enum {
+    FD_READ, FD_WRITE,
+    FD_EVENT    // an eventfd, the FdList reads its counter into fd_node.value
+} FdType;
 
 struct fd_node;
 
 typedef int (*fd_handler_t)(struct fd_node* node);
 
 struct fd_node {
-    int fd;
+    int fd;             // -1 once deleted, while its io_uring request is still in flight
     void* context;
     fd_handler_t handler;
+    FdType type;
+    uint64_t value;     // FD_EVENT: the counter read from the eventfd
+    int armed;          // io_uring: a poll or read request is in flight
+    struct fd_node* next;   // io_uring: on FdList.dead
 };
 
+/* epoll或io_uring实现：注册和删除是O(1)，每次只处理就绪的fd
+ * read_fds/write_fds按fd下标，没有注册的是NULL，FD_EVENT也在read_fds里
+ */
 typedef struct {
-    struct fd_node read_fds[FD_LIST_SIZE];
-    struct fd_node write_fds[FD_LIST_SIZE];     // 似乎没有使用
+    int epfd;           // -1 with io_uring
+    Uring* uring;       // NULL with epoll
+    struct fd_node* dead;   // deleted nodes waiting for their request to finish
+    uint32_t size;      // entries of read_fds and write_fds
+    struct fd_node** read_fds;
+    struct fd_node** write_fds;     // 似乎没有使用
     uint32_t ms;     // poll timeout value in ms
 } FdList;
 
-// FD_WRITE并未使用
-typedef enum {
-    FD_READ, FD_WRITE
-} FdType;
-
 #define FD_LIST_SELECT_POLL     (0)     // poll and exit
 #define FD_LIST_SELECT_5        (200)   // 5 times per sec
 #define FD_LIST_SELECT_2        (500)   // 2 times per sec
@@ -45,5 +72,7 @@ int init_fd_list(FdList* fd_list, uint32_t ms);
 int add_fd_list(FdList* fd_list, FdType type, int fd, void* context, fd_handler_t handler);
 int del_fd_list(FdList* fd_list, FdType type, int fd);
 int traverse_fd_list(FdList* fd_list);
+int notify_fd_list(FdList* fd_list, int fd);
+void end_fd_list(FdList* fd_list);
 
 #endif /* FD_H_ */
@@ -0,0 +1,72 @@
+/*
+ * mempool.h
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef MEMPOOL_H_
+#define MEMPOOL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "vring.h"
+
+// max buffers a MempoolCache holds, it trades half of that with the pool at once
+#define MEMPOOL_CACHE_SIZE  64
+
+struct Mempool;
+
+/* 包buffer：一个包是用next串起来的一串PktBuf，包头和包长只在第一个里
+ * 每个PktBuf有自己的引用计数，减到0时回到mempool
+ */
+typedef struct PktBuf {
+    struct PktBuf* next;    // next segment, NULL for the last one
+    struct Mempool* pool;
+    atomic_uint refcnt;
+    uint32_t len;           // data bytes in this segment
+    uint32_t pkt_len;       // first segment: data bytes of the whole packet
+    struct virtio_net_hdr_mrg_rxbuf hdr;    // first segment: the packet header
+    uint8_t data[];         // Mempool.data_size bytes
+} PktBuf;
+
+/* 预分配的定长PktBuf，建好之后热路径上不再malloc
+ * 空闲的buffer大多在各线程的MempoolCache里，lock只在cache整批存取时用
+ */
+typedef struct Mempool {
+    pthread_mutex_t lock;   // protects free
+    uint32_t num;
+    uint32_t data_size;     // data bytes of one PktBuf
+    size_t elt_size;        // sizeof(PktBuf) + data_size, cache line aligned
+    uint32_t free_num;
+    PktBuf** free;
+    uint8_t* mem;
+} Mempool;
+
+/* 一个线程独占的空闲buffer缓存，存取不加锁
+ * 空了从pool取MEMPOOL_CACHE_SIZE/2个，满了还回去一半
+ */
+typedef struct {
+    Mempool* pool;
+    uint32_t num;
+    PktBuf* bufs[MEMPOOL_CACHE_SIZE];
+} MempoolCache;
+
+Mempool* new_mempool(uint32_t num, uint32_t data_size);
+void free_mempool(Mempool* pool);
+void init_mempool_cache(MempoolCache* cache, Mempool* pool);
+void flush_mempool_cache(MempoolCache* cache);
+
+int alloc_pktbuf_bulk(MempoolCache* cache, PktBuf* bufs[], uint32_t n);
+PktBuf* alloc_pktbuf(MempoolCache* cache);
+void ref_pktbuf(PktBuf* buf);
+void free_pktbuf(MempoolCache* cache, PktBuf* buf);
+
+PktBuf* new_pktbuf(MempoolCache* cache, const VringPacket* pkt);
+int pktbuf_to_packet(const PktBuf* buf, VringPacket* pkt);
+
+#endif /* MEMPOOL_H_ */
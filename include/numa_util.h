@@ -0,0 +1,28 @@
+/*
+ * numa_util.h
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef NUMA_UTIL_H_
+#define NUMA_UTIL_H_
+
+#include <stddef.h>
+
+// nodes numa_bind can name, its nodemask is one unsigned long
+#define NUMA_NODES_MAX      64
+
+/* 直接用get_mempolicy/mbind系统调用，不依赖libnuma
+ * 没有NUMA的机器上所有内存和CPU都在node 0
+ * 不知道时返回-1，调用者应当当作"任意node"
+ */
+int numa_num_nodes(void);
+int numa_node_of_addr(const void* addr);
+int numa_node_of_cpu(int cpu);
+int numa_bind(void* addr, size_t len, int node);
+
+#endif /* NUMA_UTIL_H_ */
@@ -0,0 +1,33 @@
+/*
+ * offload.h
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef OFFLOAD_H_
+#define OFFLOAD_H_
+
+#include "vring.h"
+
+// max segments software TSO cuts one GSO frame into
+#define OFFLOAD_SEG_MAX     128
+// max Ethernet + IP + TCP header length of a GSO frame
+#define OFFLOAD_HDR_MAX     256
+
+/* 软件offload的工作区：GSO帧先拷成连续的frame，再分段到seg
+ * pkts是处理后的包，iov指向frame或seg，包头全0
+ */
+typedef struct {
+    uint8_t frame[VRING_FRAME_MAX];
+    uint8_t seg[VRING_FRAME_MAX + OFFLOAD_SEG_MAX * OFFLOAD_HDR_MAX];
+    VringPacket pkts[OFFLOAD_SEG_MAX];
+} Offload;
+
+int need_sw_offload(uint64_t features, const VringPacket* pkt);
+int sw_offload(Offload* offload, const VringPacket* pkt);
+
+#endif /* OFFLOAD_H_ */
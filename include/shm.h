@@ -1,12 +1,30 @@
 #ifndef SHM_H_
 #define SHM_H_
 
-#define SHM_NAME_PREFIX    "/vhost"
+#include <stddef.h>
+
+// memfd name, only a label: it needn't be unique
+#define SHM_NAME_PREFIX    "vhost"
+
+// page sizes create_shm may back a region with, -DSHM_NO_HUGEPAGES keeps 4K
+#define SHM_PAGE_SIZE_4K   (4UL*1024)
+#define SHM_PAGE_SIZE_2M   (2UL*1024*1024)
+#define SHM_PAGE_SIZE_1G   (1024UL*1024*1024)
+
+// map_shm flags: prefault the whole region, and keep it resident
+#define SHM_F_POPULATE     (1 << 0)
+#define SHM_F_LOCK         (1 << 1)
+
+// how both sides map the regions, a lazily mapped ring faults on the data path
+#ifndef SHM_MAP_FLAGS
+#define SHM_MAP_FLAGS      (SHM_F_POPULATE | SHM_F_LOCK)
+#endif
 
 // shared memory interface
 extern int shm_fds[];
-void* create_shm(size_t size, int idx);
-void* map_shm(int fd, size_t size);
+extern size_t shm_page_sizes[];
+void* create_shm(size_t* size, int idx);
+void* map_shm(int fd, size_t size, int flags);
 int unmap_shm(void* ptr, size_t size);
 int end_shm(void* ptr, size_t size, int idx);
 int sync_shm(void* ptr, size_t size);
@@ -0,0 +1,48 @@
+/*
+ * uring.h
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/* 直接用io_uring_setup/io_uring_enter系统调用的最小封装，不依赖liburing
+ * 只由一个线程使用
+ */
+typedef struct {
+    int fd;
+    uint32_t flags;         // IORING_SETUP_* in use
+    uint32_t sq_entries;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_flags;
+    uint32_t* sq_array;
+    struct io_uring_sqe* sqes;
+    uint32_t sqe_tail;      // sqes handed out by uring_get_sqe, published by uring_submit
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring;             // SQ and CQ rings share one mapping
+    size_t ring_size;
+    size_t sqes_size;
+} Uring;
+
+int init_uring(Uring* uring, uint32_t entries, uint32_t sqpoll_ms);
+void end_uring(Uring* uring);
+struct io_uring_sqe* uring_get_sqe(Uring* uring);
+int uring_submit(Uring* uring, uint32_t wait_nr, int ms);
+struct io_uring_cqe* uring_peek_cqe(Uring* uring);
+void uring_cqe_seen(Uring* uring);
+
+#endif /* URING_H_ */
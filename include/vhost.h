@@ -40,4 +40,11 @@ struct virtio_net_hdr
     uint16_t csum_offset;
 };
 
+// header with VIRTIO_NET_F_MRG_RXBUF, the packet spans num_buffers ring entries
+struct virtio_net_hdr_mrg_rxbuf
+{
+    struct virtio_net_hdr hdr;
+    uint16_t num_buffers;
+};
+
 #endif /* VHOST_H_ */
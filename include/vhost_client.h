@@ -16,20 +16,49 @@
 #include "vring.h"
 #include "vhost_user.h"
 
+// features the client can use, override with -DVHOST_CLIENT_FEATURES=... to restrict them
+#ifndef VHOST_CLIENT_FEATURES
+#define VHOST_CLIENT_FEATURES   ((1ULL << VIRTIO_F_RING_PACKED) \
+                                | (1ULL << VRING_F_EVENT_IDX) \
+                                | (1ULL << VRING_F_INDIRECT_DESC) \
+                                | (1ULL << VIRTIO_NET_F_MRG_RXBUF) \
+                                | (1ULL << VIRTIO_NET_F_CSUM) \
+                                | (1ULL << VIRTIO_NET_F_GUEST_CSUM) \
+                                | (1ULL << VIRTIO_NET_F_HOST_TSO4) \
+                                | (1ULL << VIRTIO_NET_F_HOST_TSO6) \
+                                | (1ULL << VIRTIO_NET_F_GUEST_TSO4) \
+                                | (1ULL << VIRTIO_NET_F_GUEST_TSO6) \
+                                | (1ULL << VIRTIO_NET_F_MQ) \
+                                | (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+#endif
+
+#define VHOST_CLIENT_PROTOCOL_FEATURES  (1ULL << VHOST_USER_PROTOCOL_F_MQ)
+
+// every vring has its own memory region
+#define VHOST_CLIENT_QUEUE_PAIRS_MAX    (VHOST_MEMORY_MAX_NREGIONS / VHOST_CLIENT_VRING_NUM)
+
+// default ring size of each queue, small rings stay in the cache
+#ifndef VHOST_CLIENT_VRING_SIZE
+#define VHOST_CLIENT_VRING_SIZE 256
+#endif
+
 typedef struct {
     UnSock* unsock;
     VhostUserMemory memory;
     uint64_t features;           // features negotiated with the server
+    uint64_t protocol_features;  // with VHOST_USER_F_PROTOCOL_FEATURES
 
-    struct vhost_vring* vring_table_shm[VHOST_CLIENT_VRING_NUM];
+    // requested by new_vhost_client, then limited by VHOST_USER_GET_QUEUE_NUM
+    uint32_t queue_pairs;
+    struct vhost_vring* vring_table_shm[VHOST_MEMORY_MAX_NREGIONS];
 
     VringTable vring_table;
-    size_t  page_size;
+    unsigned int vring_num[VHOST_MEMORY_MAX_NREGIONS];  // ring size of each queue
 
     Stat stat;
 } VhostClient;
 
-VhostClient* new_vhost_client(const char* path);
+VhostClient* new_vhost_client(const char* path, unsigned int vring_num, uint32_t queue_pairs);
 
 int init_vhost_client(VhostClient* vhost_client);
 int end_vhost_client(VhostClient* vhost_client);
@@ -13,31 +13,136 @@
 
 #include "vring.h"
 #include "stat.h"
+#include "offload.h"
+#include "mempool.h"
+#include "numa_util.h"
+#include "vhost_user.h"
+#include "worker.h"
+
+// offloads the server carries end to end, or completes in software (offload.c)
+#define VHOST_SERVER_OFFLOAD_FEATURES   ((1ULL << VIRTIO_NET_F_CSUM) \
+                                        | (1ULL << VIRTIO_NET_F_GUEST_CSUM) \
+                                        | (1ULL << VIRTIO_NET_F_HOST_TSO4) \
+                                        | (1ULL << VIRTIO_NET_F_HOST_TSO6) \
+                                        | (1ULL << VIRTIO_NET_F_GUEST_TSO4) \
+                                        | (1ULL << VIRTIO_NET_F_GUEST_TSO6))
+
+// features offered to the client
+#define VHOST_SERVER_FEATURES   ((1ULL << VIRTIO_F_RING_PACKED) \
+                                | (1ULL << VRING_F_EVENT_IDX) \
+                                | (1ULL << VRING_F_INDIRECT_DESC) \
+                                | (1ULL << VIRTIO_NET_F_MRG_RXBUF) \
+                                | (1ULL << VIRTIO_NET_F_MQ) \
+                                | (1ULL << VHOST_USER_F_PROTOCOL_FEATURES) \
+                                | VHOST_SERVER_OFFLOAD_FEATURES)
+
+#define VHOST_SERVER_PROTOCOL_FEATURES  (1ULL << VHOST_USER_PROTOCOL_F_MQ)
+
+// queue pairs reported by VHOST_USER_GET_QUEUE_NUM
+#define VHOST_SERVER_QUEUE_PAIRS_MAX    8
+// max number of poll-mode worker threads
+#define VHOST_SERVER_WORKERS_MAX        16
+// how often the control thread evens out the busy cycles of the workers
+#define VHOST_SERVER_REBALANCE_MS       1000
+// rebalance once the load gap is at least 1/SKEW of the busiest worker's load
+#define VHOST_SERVER_REBALANCE_SKEW     4
+// rebalances a queue pair sits out after it has been moved
+#define VHOST_SERVER_REBALANCE_HOLD     4
+// packet buffers shared by all queue pairs, and the data bytes of one
+#define VHOST_SERVER_MEMPOOL_SIZE       8192
+#define VHOST_SERVER_PKTBUF_SIZE        2048
+// packets one queue pair holds while its RX ring is full
+#define VHOST_SERVER_RX_PENDING_MAX     1024
+/* 自适应轮询：TX ring连续STREAK次有包(间隔都小于IDLE_US)，或取满一个burst，
+ * 就关掉kick忙轮询；空闲IDLE_US之后重新打开kick，等kick再处理
+ * 只有一个CPU时轮询只会和client抢CPU，一取空就打开kick
+ */
+#ifndef VHOST_SERVER_POLL_IDLE_US
+#define VHOST_SERVER_POLL_IDLE_US       1000
+#endif
+#define VHOST_SERVER_POLL_STREAK        4
 
 typedef struct {
     uint64_t guest_phys_addr;
     uint64_t memory_size;
     uint64_t userspace_addr;
-    uint64_t mmap_addr;
+    uint64_t mmap_addr;     // the mapping plus mmap_offset
+    uint64_t mmap_offset;
+    int node;               // NUMA node of the mapping, -1 unknown
 } VhostServerMemoryRegion;
 
+// guest物理地址查找表的一项，[start, end)映射到addr + offset
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;    // mmap_addr - guest_phys_addr, modulo 2^64
+} VhostServerMemoryRange;
+
 typedef struct {
     uint32_t nregions;
     VhostServerMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    /* regions按guest_phys_addr排序，二分查找。last_hit是上次命中的一项，
+     * 包的buffer大多在同一个region里，通常查一次就中
+     */
+    VhostServerMemoryRange ranges[VHOST_MEMORY_MAX_NREGIONS];
+    atomic_uint last_hit;
 } VhostServerMemory;
 
+// 每个queue pair的转发状态，TX ring的包转发到同一queue pair的RX ring
+typedef struct {
+    // packets taken from the TX ring, held until they are copied to the RX ring
+    VringPacket tx_pkts[VRING_BURST_MAX];
+    uint32_t tx_pkts_num;
+    int tx_backlog;     // TX ring里可能还有包，不能等kick
+    int polling;        // busy-polled with the kicks off, see _adapt_queue
+    int no_kick;        // the client gave no kickfd, the TX ring is always polled
+    uint32_t busy_streak;   // polls with packets, each within the idle period of the last
+    uint64_t last_busy; // us, the last poll that found packets
+    Offload offload;    // software checksum/TSO for packets the client can't take as they are
+    /* RX ring放不下的包拷到mempool，按顺序在这里等下次放入
+     * 只由处理这个queue pair的线程访问，cache也一样
+     */
+    MempoolCache cache;
+    PktBuf* rx_pending[VHOST_SERVER_RX_PENDING_MAX];
+    uint32_t rx_pending_head;
+    uint32_t rx_pending_num;
+    Worker* worker;     // 轮询这个queue pair的线程，NULL表示由控制线程处理
+    int node;           // NUMA node of the TX ring, -1 unknown
+    atomic_int ready;   // both rings set up and enabled, the worker may touch them
+    _Atomic uint64_t processed; // packets taken from the TX ring
+    uint64_t reported;  // processed already counted in VhostServer.stat
+    _Atomic uint64_t busy;      // worker_cycles spent in polls that found packets
+    uint64_t busy_last; // busy at the last rebalance
+    uint32_t rebalance_hold;    // rebalances left before the pair may move again
+} VhostServerQueue;
+
 typedef struct {
     UnSock* unsock;
     VhostServerMemory memory;
-    VringTable vring_table;
+    VringTable vring_table;     // VHOST_CLIENT_VRING_NUM vrings per queue pair
+    uint64_t protocol_features;
 
-    int is_polling;
-    uint8_t buffer[BUFFER_SIZE];    // a vhost private buffer for unkown usage
-    uint32_t buffer_size;   // size of buffer ^ used
+    uint32_t queue_pairs;
+    VhostServerQueue* queues;   // queue_pairs entries
+    Mempool* mempool;           // buffers of the packets held in rx_pending
+    /* 有多个NUMA node时，queue pair改用它的rings所在node上的mempool
+     * 第一个queue pair落到这个node上时才创建
+     */
+    int numa_nodes;
+    Mempool* node_mempools[NUMA_NODES_MAX];
+    /* 控制线程拥有UnSock，处理vhost消息，worker线程忙轮询vring
+     * 没有worker时，控制线程在poll_server里轮询
+     */
+    uint32_t worker_num;
+    Worker* workers[VHOST_SERVER_WORKERS_MAX];
+    int worker_nodes[VHOST_SERVER_WORKERS_MAX];     // node of the worker's CPU, -1 not pinned
+    struct timespec rebalanced;     // time of the last rebalance
+    uint64_t poll_idle_us;  // VHOST_SERVER_POLL_IDLE_US, 0 on a single CPU
     Stat stat;
 } VhostServer;
 
 VhostServer* new_vhost_server(const char* path, int is_listen);
+int add_vhost_server_worker(VhostServer* vhost_server, int cpu);
 int end_vhost_server(VhostServer* vhost_server);
 int run_vhost_server(VhostServer* vhost_server);
 
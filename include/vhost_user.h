@@ -30,6 +30,17 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+/* Feature bit VHOST_USER_F_PROTOCOL_FEATURES signals slave support for
+ * VHOST_USER_GET_PROTOCOL_FEATURES and VHOST_USER_SET_PROTOCOL_FEATURES.
+ * Once negotiated the rings start disabled, see VHOST_USER_SET_VRING_ENABLE.
+ */
+#define VHOST_USER_F_PROTOCOL_FEATURES  30
+
+// protocol feature bits
+enum {
+    VHOST_USER_PROTOCOL_F_MQ = 0    // VHOST_USER_GET_QUEUE_NUM is supported
+};
+
 /* Definition for vhost user requests
  */
 typedef enum VhostUserRequest {
@@ -48,6 +59,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_MAX
 } VhostUserRequest;
 
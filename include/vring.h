@@ -11,9 +11,11 @@
 #ifndef VRING_H_
 #define VRING_H_
 
+#include <sys/uio.h>
+
 #include "common.h"
 
-// Number of vring structures used in Linux vhost. Max 32768.
+// Max number of vring structures used in Linux vhost, the size is negotiated by SET_VRING_NUM
 enum { VHOST_VRING_SIZE = 32*1024 };
 
 // vring_desc I/O buffer descriptor
@@ -38,11 +40,58 @@ enum { // flags for avail and used rings
   VRING_F_EVENT_IDX     = 29  // (Some boring complicated interrupt behavior..)
 };
 
+// feature bits, negotiated through VHOST_USER_GET/SET_FEATURES
+enum {
+  VIRTIO_NET_F_CSUM       = 0,  // device takes packets with a partial checksum
+  VIRTIO_NET_F_GUEST_CSUM = 1,  // driver takes packets with a partial checksum
+  VIRTIO_NET_F_GUEST_TSO4 = 7,  // driver takes TCPv4 GSO frames
+  VIRTIO_NET_F_GUEST_TSO6 = 8,  // driver takes TCPv6 GSO frames
+  VIRTIO_NET_F_GUEST_ECN  = 9,  // driver takes GSO frames with ECN set
+  VIRTIO_NET_F_HOST_TSO4  = 11, // device takes TCPv4 GSO frames
+  VIRTIO_NET_F_HOST_TSO6  = 12, // device takes TCPv6 GSO frames
+  VIRTIO_NET_F_MRG_RXBUF  = 15, // a packet may span several buffers, see num_buffers
+  VIRTIO_NET_F_MQ         = 22, // several RX/TX queue pairs, see VHOST_USER_GET_QUEUE_NUM
+  VIRTIO_F_RING_PACKED    = 34  // packed virtqueue layout
+};
+
+#define VRING_HAS_FEATURE(vring_table, f)   (((vring_table)->features >> (f)) & 1)
+
+// packed ring descriptor, uses the memory of the split desc table
+struct vring_packed_desc {
+  uint64_t addr;  // packet data buffer address
+  uint32_t len;   // packet data buffer size
+  uint16_t id;    // buffer id
+  uint16_t flags; // VIRTIO_DESC_F_* and the two flags below
+};
+
+// packed vring_packed_desc.flags, compared against the wrap counters
+enum {
+  VRING_PACKED_DESC_F_AVAIL = 1 << 7,
+  VRING_PACKED_DESC_F_USED  = 1 << 15
+};
+
+// packed ring event suppression, placed in the avail (driver) and used (device) areas
+struct vring_packed_desc_event {
+  uint16_t off_wrap;
+  uint16_t flags;
+};
+
+// packed vring_packed_desc_event.flags
+enum {
+  VRING_PACKED_EVENT_FLAG_ENABLE  = 0,  // notify on every buffer
+  VRING_PACKED_EVENT_FLAG_DISABLE = 1,  // don't notify
+  VRING_PACKED_EVENT_FLAG_DESC    = 2   // notify at off_wrap (VRING_F_EVENT_IDX)
+};
+
+// bit 15 of the packed ring base carries the wrap counter
+#define VRING_PACKED_WRAP_COUNTER_BIT   15
+
 // ring of descriptors that are available to be processed
 struct vring_avail {
   uint16_t flags;
   uint16_t idx;
-  uint16_t ring[VHOST_VRING_SIZE];
+  uint16_t ring[];
+  // uint16_t used_event follows ring[num], see vring_used_event
 };
 
 struct vring_used_elem {
@@ -54,40 +103,142 @@ struct vring_used_elem {
 struct vring_used {
   uint16_t flags;
   uint16_t idx;
-  struct vring_used_elem ring[VHOST_VRING_SIZE];
+  struct vring_used_elem ring[];
+  // uint16_t avail_event follows ring[num], see vring_avail_event
 };
 
-// 位于该结构共享内存
+// VRING_F_EVENT_IDX: used index the producer wants to be told about
+#define vring_used_event(avail, num)    (&(avail)->ring[(num)])
+// VRING_F_EVENT_IDX: avail index the consumer wants a kick at
+#define vring_avail_event(used, num) \
+            ((uint16_t*) ((char*)(used)->ring + (num) * sizeof(struct vring_used_elem)))
+
+#define VRING_USED_ALIGN    4096
+
+/* 位于该结构共享内存，大小num由SET_VRING_NUM协商
+ * 后面依次是desc[num]、avail、used (VRING_USED_ALIGN对齐)，然后是每个desc的buffer
+ */
 struct vhost_vring {
   int kickfd, callfd;
-  struct vring_desc desc[VHOST_VRING_SIZE] __attribute__((aligned(4)));
-  struct vring_avail avail                 __attribute__((aligned(2)));
-  struct vring_used used                   __attribute__((aligned(4096)));
+  uint32_t num;
+  struct vring_desc desc[] __attribute__((aligned(16)));
 };
 
+static inline size_t vring_avail_offset(unsigned int num)
+{
+  return sizeof(struct vhost_vring) + num * sizeof(struct vring_desc);
+}
+
+static inline size_t vring_used_offset(unsigned int num)
+{
+  return ALIGN(vring_avail_offset(num) + sizeof(struct vring_avail)
+          + (num + 1) * sizeof(uint16_t), VRING_USED_ALIGN);
+}
+
+// size of struct vhost_vring with its rings, the buffers excluded
+static inline size_t vring_size(unsigned int num)
+{
+  return vring_used_offset(num) + sizeof(struct vring_used)
+          + num * sizeof(struct vring_used_elem) + sizeof(uint16_t);
+}
+
+static inline struct vring_avail* vhost_vring_avail(struct vhost_vring* vring)
+{
+  return (struct vring_avail*) ((char*)vring + vring_avail_offset(vring->num));
+}
+
+static inline struct vring_used* vhost_vring_used(struct vhost_vring* vring)
+{
+  return (struct vring_used*) ((char*)vring + vring_used_offset(vring->num));
+}
+
 typedef int (*avail_handler_t)(void* context, void* buf, size_t size);
 typedef uintptr_t (*map_handler_t)(void* context, uint64_t addr);
+// translates n addresses at once, 0 for the ones not mapped
+typedef void (*map_burst_handler_t)(void* context, const uint64_t addr[], uintptr_t result[],
+        uint32_t n);
+// takes over the eventfd write of kick(), returns non-zero to leave it to kick()
+typedef int (*kick_handler_t)(void* context, uint32_t v_idx);
+
+// max number of packets dequeue_burst hands out in one call
+#define VRING_BURST_MAX     32
+/* software prefetch distances of the burst paths, in packets, 0 turns it off
+ * the descriptor of packet N+DESC and the payload of packet N+DATA are
+ * prefetched while packet N is processed, DATA must not exceed DESC
+ */
+#ifndef VRING_PREFETCH_DESC
+#define VRING_PREFETCH_DESC 8
+#endif
+#ifndef VRING_PREFETCH_DATA
+#define VRING_PREFETCH_DATA (VRING_PREFETCH_DESC / 2)
+#endif
+
+// largest frame carried through the rings, jumbo or GSO
+#define VRING_FRAME_MAX     (64*1024)
+// max number of payload segments, and of merged buffers, of one packet
+#define VRING_IOV_MAX       ((VRING_FRAME_MAX + BUFFER_SIZE - 1) / BUFFER_SIZE + 1)
+
+/* a packet taken from the avail ring by dequeue_burst, returned by release_burst
+ * the payload is not copied, iov points to the translated guest buffers and
+ * stays valid until the packet is released.
+ */
+typedef struct {
+  uint16_t id;              // head descriptor index, written back to the used ring
+  uint16_t num_desc;        // ring slots taken by the chain (packed ring)
+  uint32_t len;             // length of the descriptor chain
+} VringBuf;
+
+typedef struct {
+  uint16_t num_buffers;     // ring entries merged into the packet (VIRTIO_NET_F_MRG_RXBUF)
+  VringBuf buf[VRING_IOV_MAX];
+  uint32_t len;             // total length of all the buffers
+  size_t size;              // payload size, virtio_net_hdr excluded
+  struct virtio_net_hdr_mrg_rxbuf hdr;  // copy of the packet header
+  uint32_t iov_cnt;
+  struct iovec iov[VRING_IOV_MAX];  // payload segments, virtio_net_hdr stripped
+} VringPacket;
 
 typedef struct {
   int kickfd, callfd;
   struct vring_desc* desc;
   struct vring_avail* avail;
   struct vring_used* used;
-  unsigned int num;         // vring的大小，VHOST_VRING_SIZE
-  uint16_t last_avail_idx;
+  unsigned int num;         // vring的大小，最大VHOST_VRING_SIZE
+  uint16_t last_avail_idx;  // consumer, and the packed ring producer
   uint16_t last_used_idx;
+  /* packed ring only: wrap counters matching last_avail_idx/last_used_idx.
+   * The producer's buffers are bound to their slot, the consumer completes
+   * them in order.
+   */
+  uint8_t avail_wrap_counter;
+  uint8_t used_wrap_counter;
+  /* producer: descriptors not in flight. The split ring keeps their indexes
+   * in the free_ids[0, num_free) stack, allocated by set_vring_base.
+   */
+  uint16_t num_free;
+  uint16_t* free_ids;
+  uint16_t* chain_len;      // packed ring producer: slots of the chain published at each slot
+  uint16_t num_added;       // producer: buffers published since the last kick
+  uint8_t notify_off;       // consumer: kicks turned off by vring_set_notify
+  uint8_t enabled;          // VHOST_USER_SET_VRING_ENABLE
 } Vring;
 
 struct VhostUserMemory;
 
 #define VHOST_CLIENT_VRING_IDX_RX   0
 #define VHOST_CLIENT_VRING_IDX_TX   1
-#define VHOST_CLIENT_VRING_NUM      2
+#define VHOST_CLIENT_VRING_NUM      2   // vrings of one queue pair
+
+// vring index of the RX or TX ring of queue pair qp, the pairs are laid out in order
+#define VHOST_VRING_IDX(qp, idx)    ((qp) * VHOST_CLIENT_VRING_NUM + (idx))
+#define VHOST_VRING_QP(v_idx)       ((v_idx) / VHOST_CLIENT_VRING_NUM)
+#define VHOST_VRING_IS_TX(v_idx)    ((v_idx) % VHOST_CLIENT_VRING_NUM == VHOST_CLIENT_VRING_IDX_TX)
 
 
-int set_host_vring(UnSock* client, struct vhost_vring *vring, int index);
+int set_host_vring(UnSock* client, struct vhost_vring *vring, int index, uint64_t features);
 
-int set_host_vring_table(struct vhost_vring* vring_table[], size_t vring_table_num, UnSock* client);
+int set_host_vring_table(struct vhost_vring* vring_table[], size_t vring_table_num, UnSock* client,
+        uint64_t features);
 
 // client/server两端各自维护的一份结构，只有struct vhost_vring位于共享内存
 typedef struct {
@@ -95,15 +246,32 @@ typedef struct {
     void* context;  // VhostClient or VhostServer instance
     avail_handler_t avail_handler;  // avail_handler_client or avail_handler_server
     map_handler_t map_handler;  // map_handler (server only)
-    Vring vring[VHOST_CLIENT_VRING_NUM];
+    map_burst_handler_t map_burst_handler;  // map_burst_handler (server only), or NULL
+    kick_handler_t kick_handler;    // kick_handler, or NULL
+    uint64_t features;  // negotiated features
+    uint32_t num_vrings;    // VHOST_CLIENT_VRING_NUM per queue pair
+    Vring* vring;       // allocated by init_vring_table
 } VringTable;
 
-struct vhost_vring* new_vring(void* vring_base);
+int init_vring_table(VringTable* vring_table, uint32_t num_vrings);
+void free_vring_table(VringTable* vring_table);
+
+size_t vring_mem_size(unsigned int num);
+struct vhost_vring* new_vring(void* vring_base, unsigned int num, uint64_t features);
 int init_vring(VringTable *vring_table, uint32_t v_idx);
+int set_vring_base(VringTable *vring_table, uint32_t v_idx, uint32_t base);
+uint32_t get_vring_base(VringTable *vring_table, uint32_t v_idx);
 int put_vring(VringTable* vring_table, uint32_t v_idx, void* buf, size_t size);
+int put_vring_iov(VringTable* vring_table, uint32_t v_idx, const struct iovec* iov, uint32_t iov_cnt);
+int put_vring_burst(VringTable* vring_table, uint32_t v_idx, VringPacket pkts[], uint32_t count);
 int process_used_vring(VringTable* vring_table, uint32_t v_idx);
 int process_avail_vring(VringTable* vring_table, uint32_t v_idx);
+int dequeue_burst(VringTable* vring_table, uint32_t v_idx, VringPacket pkts[], uint32_t max);
+int release_burst(VringTable* vring_table, uint32_t v_idx, VringPacket pkts[], uint32_t count);
 
+int vring_set_notify(VringTable* vring_table, uint32_t v_idx, int enable);
 int kick(VringTable* vring_table, uint32_t v_idx);
 
+size_t iov_to_buf(const struct iovec* iov, uint32_t iov_cnt, void* buf, size_t size);
+
 #endif /* VRING_H_ */
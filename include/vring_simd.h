@@ -0,0 +1,29 @@
+/*
+ * vring_simd.h
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VRING_SIMD_H_
+#define VRING_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// descriptors dequeue_burst takes in one batch, when they are contiguous
+#define VRING_BATCH         4
+
+/* VRING_BATCH个连续的16字节desc (split和packed一样大)，off是16位flags的偏移
+ * 全部满足(flags & mask) == expect时返回1
+ * 第一次调用前按CPU选好AVX2/SSE4.2/标量实现
+ */
+int vring_batch_flags(const void* desc, size_t off, uint16_t mask, uint16_t expect);
+
+// 选中的实现，打印用
+const char* vring_simd_name(void);
+
+#endif /* VRING_SIMD_H_ */
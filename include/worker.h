@@ -0,0 +1,77 @@
+/*
+ * worker.h
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef WORKER_H_
+#define WORKER_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// max number of queues one worker polls
+#define WORKER_QUEUE_MAX    64
+// longest sleep of a worker whose queues all wait for kicks
+#define WORKER_SLEEP_MS     200
+
+// handler result: the queue waits for a kick on its watched fd, the worker may sleep
+#define WORKER_IDLE         (-1)
+
+// polls one queue, returns the number of packets processed or WORKER_IDLE
+typedef int (*worker_handler_t)(void* context, uint32_t queue);
+
+/* poll-mode线程，绑定到一个CPU，忙轮询分配给它的queue
+ * queues由控制线程修改，worker每轮重新读取
+ * 一轮里所有queue都返回WORKER_IDLE时，在epfd上睡眠，直到watch的fd被kick，
+ * 或者wake_worker
+ */
+typedef struct {
+    pthread_t thread;
+    uint32_t id;
+    int cpu;                    // pinned CPU, -1 not pinned
+    void* context;              // passed to handler
+    worker_handler_t handler;
+    atomic_int running;
+    atomic_uint epoch;          // 每轮轮询结束加1，见sync_worker
+    atomic_uint queue_num;
+    atomic_uint queues[WORKER_QUEUE_MAX];
+    int epfd;                   // the watched fds and wakefd, edge-triggered
+    int wakefd;                 // eventfd, see wake_worker
+} Worker;
+
+// 计时用于统计busy cycles，x86上是TSC，其它平台是ns
+static inline uint64_t worker_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+Worker* new_worker(uint32_t id, int cpu, void* context, worker_handler_t handler);
+void free_worker(Worker* worker);
+int start_worker(Worker* worker);
+int stop_worker(Worker* worker);
+int worker_watch_fd(Worker* worker, int fd);
+int worker_unwatch_fd(Worker* worker, int fd);
+void wake_worker(Worker* worker);
+int add_worker_queue(Worker* worker, uint32_t queue);
+int del_worker_queue(Worker* worker, uint32_t queue);
+void sync_worker(Worker* worker);
+int move_worker_queue(Worker* from, Worker* to, uint32_t queue);
+
+#endif /* WORKER_H_ */
@@ -38,7 +38,7 @@ int main(int argc, char* argv[])
         switch (opt) {
         case 'q':
             /* vhost-user client, can be qemu */
-            vhost_master = new_vhost_client(optarg);
+            vhost_master = new_vhost_client(optarg, VHOST_CLIENT_VRING_SIZE, 1);
             break;
         case 's':
             /* vhost-user backend, who creates the unit domain socket */
@@ -0,0 +1,146 @@
+/*
+ * test_rx_drop.c
+ *
+ * Copyright (c) 2014 Virtual Open Systems Sarl.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/* 坏的TX链不能转发到RX ring：在TX ring里放两个正常的包和三个坏链，
+ * 转发一轮之后RX ring里只有两个正常的包，五个TX项都已归还
+ * 直接包含vhost_server.c，用它的static函数，不需要socket和client
+ */
+#define main vhost_server_main
+#include "../demo/vhost_server.c"
+#undef main
+
+#define TEST_VRING_NUM      16
+#define TEST_FRAME_LEN      60
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+// 一个vring和它的buffer，布局和client的一样 (new_vring)
+static struct vhost_vring* _new_test_vring(void)
+{
+    size_t size = ALIGN(vring_mem_size(TEST_VRING_NUM), BUFFER_ALIGNMENT);
+    void* mem = aligned_alloc(BUFFER_ALIGNMENT, size);
+
+    if (!mem) {
+        return NULL;
+    }
+    memset(mem, 0, size);
+
+    return new_vring(mem, TEST_VRING_NUM, 0);
+}
+
+// 服务端这一侧的vring，和_set_vring_addr/_set_vring_base一样设置
+static void _attach_vring(VhostServer* vhost_server, uint32_t idx, struct vhost_vring* ring)
+{
+    Vring* vring = &vhost_server->vring_table.vring[idx];
+
+    vring->num = ring->num;
+    vring->desc = ring->desc;
+    vring->avail = vhost_vring_avail(ring);
+    vring->used = vhost_vring_used(ring);
+    vring->enabled = 1;
+    set_vring_base(&vhost_server->vring_table, idx, 0);
+}
+
+// TX ring的一项：包头加TEST_FRAME_LEN字节的帧
+static void _put_frame(struct vhost_vring* ring, uint16_t d_idx)
+{
+    ring->desc[d_idx].len = sizeof(struct virtio_net_hdr) + TEST_FRAME_LEN;
+    ring->desc[d_idx].flags = 0;
+}
+
+static void _publish(struct vhost_vring* ring, uint16_t head)
+{
+    struct vring_avail* avail = vhost_vring_avail(ring);
+
+    avail->ring[avail->idx % ring->num] = head;
+    avail->idx++;
+}
+
+int main(int argc, char* argv[])
+{
+    VhostServer* vhost_server = (VhostServer*) calloc(1, sizeof(VhostServer));
+    struct vhost_vring* rx = _new_test_vring();
+    struct vhost_vring* tx = _new_test_vring();
+    VhostServerQueue* queue;
+
+    assert(vhost_server && rx && tx);
+
+    // identity mapping, the rings live in this process
+    vhost_server->memory.nregions = 1;
+    vhost_server->memory.ranges[0].start = 0;
+    vhost_server->memory.ranges[0].end = UINT64_MAX;
+    vhost_server->memory.ranges[0].offset = 0;
+
+    // split ring, no offloads, no kickfd
+    vhost_server->vring_table.context = vhost_server;
+    vhost_server->vring_table.map_handler = map_handler;
+    vhost_server->vring_table.map_burst_handler = map_burst_handler;
+    vhost_server->vring_table.features = 0;
+    assert(init_vring_table(&vhost_server->vring_table, VHOST_VRING_IDX(1, 0)) == 0);
+
+    vhost_server->queue_pairs = 1;
+    vhost_server->queues = (VhostServerQueue*) calloc(1, sizeof(VhostServerQueue));
+    vhost_server->mempool = new_mempool(VHOST_SERVER_MEMPOOL_SIZE, VHOST_SERVER_PKTBUF_SIZE);
+    assert(vhost_server->queues && vhost_server->mempool);
+    queue = &vhost_server->queues[0];
+    init_mempool_cache(&queue->cache, vhost_server->mempool);
+    queue->node = -1;
+    queue->polling = 1;
+
+    _attach_vring(vhost_server, VHOST_VRING_IDX(0, VHOST_CLIENT_VRING_IDX_RX), rx);
+    _attach_vring(vhost_server, VHOST_VRING_IDX(0, VHOST_CLIENT_VRING_IDX_TX), tx);
+
+    // a good frame
+    _put_frame(tx, 1);
+    _publish(tx, 1);
+
+    // zero-length descriptor chained to itself
+    tx->desc[2].len = 0;
+    tx->desc[2].flags = VIRTIO_DESC_F_NEXT;
+    tx->desc[2].next = 2;
+    _publish(tx, 2);
+
+    // head out of the table
+    _publish(tx, TEST_VRING_NUM + 3);
+
+    // next out of the table
+    _put_frame(tx, 4);
+    tx->desc[4].flags = VIRTIO_DESC_F_NEXT;
+    tx->desc[4].next = TEST_VRING_NUM + 1;
+    _publish(tx, 4);
+
+    // another good frame
+    _put_frame(tx, 5);
+    _publish(tx, 5);
+
+    _poll_queue_pair(vhost_server, 0);
+
+    // only the good frames reach the RX ring, none of them is held
+    CHECK(vhost_vring_avail(rx)->idx == 2);
+    CHECK(queue->rx_pending_num == 0);
+    CHECK(rx->desc[vhost_vring_avail(rx)->ring[0]].len
+            == sizeof(struct virtio_net_hdr) + TEST_FRAME_LEN);
+    CHECK(rx->desc[vhost_vring_avail(rx)->ring[1]].len
+            == sizeof(struct virtio_net_hdr) + TEST_FRAME_LEN);
+
+    // every TX entry, broken or not, goes back to the client
+    CHECK(vhost_vring_used(tx)->idx == 5);
+
+    fprintf(stdout, "%s: %s\n", argv[0], failed ? "FAIL" : "PASS");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -25,15 +25,17 @@
 // vhost message handler
 typedef int (*MsgHandler)(VhostServer* vhost_server, ServerMsg* msg);
 
-static int avail_handler_server(void* context, void* buf, size_t size);
 static uintptr_t map_handler(void* context, uint64_t addr);
+static void map_burst_handler(void* context, const uint64_t addr[], uintptr_t result[],
+        uint32_t n);
+static int kick_handler(void* context, uint32_t v_idx);
 
 extern int app_running;
 
 VhostServer* new_vhost_server(const char* path, int is_listen)
 {
     VhostServer* vhost_server = (VhostServer*) calloc(1, sizeof(VhostServer));
-    int idx;
+    uint32_t idx;
 
     /* alloc and init socket server */
     vhost_server->unsock = new_unsock(path);
@@ -50,24 +52,77 @@ VhostServer* new_vhost_server(const char* path, int is_listen)
 
     // VringTable initalization
     vhost_server->vring_table.context = (void*) vhost_server;
-    vhost_server->vring_table.avail_handler = avail_handler_server;
+    vhost_server->vring_table.avail_handler = NULL;
     vhost_server->vring_table.map_handler = map_handler;
+    vhost_server->vring_table.map_burst_handler = map_burst_handler;
+    vhost_server->vring_table.kick_handler = kick_handler;
+    vhost_server->vring_table.features = 0;
+    vhost_server->protocol_features = 0;
+
+    // the queue pairs the client can ask for, their rings start disabled
+    vhost_server->queue_pairs = VHOST_SERVER_QUEUE_PAIRS_MAX;
+    vhost_server->queues = (VhostServerQueue*) calloc(vhost_server->queue_pairs,
+            sizeof(VhostServerQueue));
+    vhost_server->mempool = new_mempool(VHOST_SERVER_MEMPOOL_SIZE, VHOST_SERVER_PKTBUF_SIZE);
+    if (!vhost_server->queues || !vhost_server->mempool
+            || init_vring_table(&vhost_server->vring_table,
+                VHOST_VRING_IDX(vhost_server->queue_pairs, 0)) != 0) {
+        fprintf(stderr, "Unable to allocate %u queue pairs\n", vhost_server->queue_pairs);
+        close_unsock(vhost_server->unsock);
+        free(vhost_server->unsock);
+        free(vhost_server->queues);
+        if (vhost_server->mempool) {
+            free_mempool(vhost_server->mempool);
+        }
+        free(vhost_server);
+        return NULL;
+    }
 
-    for (idx = 0; idx < VHOST_CLIENT_VRING_NUM; idx++) {
-        init_vring(&vhost_server->vring_table, idx);
+    for (idx = 0; idx < vhost_server->queue_pairs; idx++) {
+        init_mempool_cache(&vhost_server->queues[idx].cache, vhost_server->mempool);
+        vhost_server->queues[idx].node = -1;
     }
+    vhost_server->numa_nodes = numa_num_nodes();
+    vhost_server->poll_idle_us = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? VHOST_SERVER_POLL_IDLE_US : 0;
 
-    vhost_server->buffer_size = 0;
-    vhost_server->is_polling = 0;
+    vhost_server->worker_num = 0;
     init_stat(&vhost_server->stat);    // init time stat struct
 
     return vhost_server;
 }
 
+static int _poll_worker(void* context, uint32_t qp);
+
+// 增加一个绑定到cpu (-1不绑定) 的poll-mode线程，run_vhost_server之前调用
+int add_vhost_server_worker(VhostServer* vhost_server, int cpu)
+{
+    Worker* worker;
+
+    if (vhost_server->worker_num == VHOST_SERVER_WORKERS_MAX) {
+        return -1;
+    }
+
+    worker = new_worker(vhost_server->worker_num, cpu, vhost_server, _poll_worker);
+    if (!worker) {
+        return -1;
+    }
+    vhost_server->worker_nodes[vhost_server->worker_num] = numa_node_of_cpu(cpu);
+    vhost_server->workers[vhost_server->worker_num++] = worker;
+
+    return 0;
+}
+
 int end_vhost_server(VhostServer* vhost_server)
 {
     int idx;
 
+    // the workers stop before the memory they poll goes away
+    for (idx = 0; idx < vhost_server->worker_num; idx++) {
+        stop_worker(vhost_server->workers[idx]);
+        free_worker(vhost_server->workers[idx]);
+    }
+    vhost_server->worker_num = 0;
+
     // End server
     close_unsock(vhost_server->unsock);
     free(vhost_server->unsock);
@@ -76,28 +131,101 @@ int end_vhost_server(VhostServer* vhost_server)
     for (idx = 0; idx < vhost_server->memory.nregions; idx++) {
         VhostServerMemoryRegion *region = &vhost_server->memory.regions[idx];
         // shm由client端分配，不要在server端调end_shm
-        unmap_shm((void*) (uintptr_t) region->userspace_addr, region->memory_size);
+        unmap_shm((void*) (uintptr_t) (region->mmap_addr - region->mmap_offset),
+                region->memory_size);
+    }
+
+    free_vring_table(&vhost_server->vring_table);
+
+    // the held packets go back before the pool itself
+    for (idx = 0; idx < vhost_server->queue_pairs; idx++) {
+        VhostServerQueue* queue = &vhost_server->queues[idx];
+
+        for (; queue->rx_pending_num; queue->rx_pending_num--) {
+            free_pktbuf(&queue->cache, queue->rx_pending[queue->rx_pending_head]);
+            queue->rx_pending_head = (queue->rx_pending_head + 1) % VHOST_SERVER_RX_PENDING_MAX;
+        }
+        flush_mempool_cache(&queue->cache);
+    }
+    free_mempool(vhost_server->mempool);
+    vhost_server->mempool = NULL;
+    for (idx = 0; idx < NUMA_NODES_MAX; idx++) {
+        if (vhost_server->node_mempools[idx]) {
+            free_mempool(vhost_server->node_mempools[idx]);
+            vhost_server->node_mempools[idx] = NULL;
+        }
     }
 
+    free(vhost_server->queues);
+    vhost_server->queues = NULL;
+
     return 0;
 }
 
+/* 二分查找addr所在的一项，没有时返回nregions
+ * 查找表只在_set_mem_table里修改，那时所有queue都已停下
+ */
+static uint32_t _find_guest_range(VhostServerMemory* memory, uint64_t addr)
+{
+    uint32_t lo = 0;
+    uint32_t hi = memory->nregions;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (addr < memory->ranges[mid].start) {
+            hi = mid;
+        } else if (addr >= memory->ranges[mid].end) {
+            lo = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+
+    return memory->nregions;
+}
+
 static uintptr_t _map_guest_addr(VhostServer* vhost_server, uint64_t addr)
 {
-    uintptr_t result = 0;
-    int idx;
+    VhostServerMemory* memory = &vhost_server->memory;
+    uint32_t hit = atomic_load_explicit(&memory->last_hit, memory_order_relaxed);
+    VhostServerMemoryRange* range = &memory->ranges[hit];
 
-    for (idx = 0; idx < vhost_server->memory.nregions; idx++) {
-        VhostServerMemoryRegion *region = &vhost_server->memory.regions[idx];
+    if (hit < memory->nregions && range->start <= addr && addr < range->end) {
+        return addr + range->offset;
+    }
 
-        if (region->guest_phys_addr <= addr
-                && addr < (region->guest_phys_addr + region->memory_size)) {
-            result = region->mmap_addr + addr - region->guest_phys_addr;
-            break;
+    hit = _find_guest_range(memory, addr);
+    if (hit == memory->nregions) {
+        return 0;
+    }
+
+    // shared by the workers, only written when it changes
+    atomic_store_explicit(&memory->last_hit, hit, memory_order_relaxed);
+
+    return addr + memory->ranges[hit].offset;
+}
+
+// 排序，建_map_guest_addr的查找表
+static void _sort_guest_ranges(VhostServerMemory* memory)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < memory->nregions; i++) {
+        VhostServerMemoryRegion* region = &memory->regions[i];
+        VhostServerMemoryRange range = {
+            .start = region->guest_phys_addr,
+            .end = region->guest_phys_addr + region->memory_size,
+            .offset = region->mmap_addr - region->guest_phys_addr,
+        };
+
+        for (j = i; j > 0 && memory->ranges[j - 1].start > range.start; j--) {
+            memory->ranges[j] = memory->ranges[j - 1];
         }
+        memory->ranges[j] = range;
     }
 
-    return result;
+    atomic_store(&memory->last_hit, 0);
 }
 
 static uintptr_t _map_user_addr(VhostServer* vhost_server, uint64_t addr)
@@ -118,11 +246,20 @@ static uintptr_t _map_user_addr(VhostServer* vhost_server, uint64_t addr)
     return result;
 }
 
+// monotonic time in us, _adapt_queue measures the idle period with it
+static uint64_t _now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int _get_features(VhostServer* vhost_server, ServerMsg* msg)
 {
     fprintf(stdout, "%s\n", __FUNCTION__);
 
-    msg->msg.u64 = 0; // no features
+    msg->msg.u64 = VHOST_SERVER_FEATURES;
     msg->msg.size = MEMBER_SIZE(VhostUserMsg,u64);
 
     return 1; // should reply back
@@ -131,9 +268,46 @@ static int _get_features(VhostServer* vhost_server, ServerMsg* msg)
 static int _set_features(VhostServer* vhost_server, ServerMsg* msg)
 {
     fprintf(stdout, "%s feature=0x%lx\n", __FUNCTION__, msg->msg.u64);
+
+    vhost_server->vring_table.features = msg->msg.u64 & VHOST_SERVER_FEATURES;
+    // the packed ring producer writes no indirect tables (_put_burst_packed)
+    if (VRING_HAS_FEATURE(&vhost_server->vring_table, VIRTIO_F_RING_PACKED)) {
+        vhost_server->vring_table.features &= ~(1ULL << VRING_F_INDIRECT_DESC);
+    }
+
+    return 0;
+}
+
+static int _get_protocol_features(VhostServer* vhost_server, ServerMsg* msg)
+{
+    fprintf(stdout, "%s\n", __FUNCTION__);
+
+    msg->msg.u64 = VHOST_SERVER_PROTOCOL_FEATURES;
+    msg->msg.size = MEMBER_SIZE(VhostUserMsg,u64);
+
+    return 1; // should reply back
+}
+
+static int _set_protocol_features(VhostServer* vhost_server, ServerMsg* msg)
+{
+    fprintf(stdout, "%s\n", __FUNCTION__);
+
+    vhost_server->protocol_features = msg->msg.u64 & VHOST_SERVER_PROTOCOL_FEATURES;
+
     return 0;
 }
 
+// VHOST_USER_GET_QUEUE_NUM (17) Slave payload: u64, max number of queue pairs
+static int _get_queue_num(VhostServer* vhost_server, ServerMsg* msg)
+{
+    fprintf(stdout, "%s\n", __FUNCTION__);
+
+    msg->msg.u64 = vhost_server->queue_pairs;
+    msg->msg.size = MEMBER_SIZE(VhostUserMsg,u64);
+
+    return 1; // should reply back
+}
+
 static int _set_owner(VhostServer* vhost_server, ServerMsg* msg)
 {
     // 是否需要清理VringTable的旧数据？
@@ -166,16 +340,23 @@ static int _set_mem_table(VhostServer* vhost_server, ServerMsg* msg)
             assert(msg->fds[idx] > 0);
 
             region->mmap_addr =
-                    (uintptr_t) map_shm(msg->fds[idx], region->memory_size);
+                    (uintptr_t) map_shm(msg->fds[idx], region->memory_size, SHM_MAP_FLAGS);
             if(region->mmap_addr == 0) {
                 LOG("%s: failed to map shared memory\n", __FUNCTION__);
             }
-            region->mmap_addr += msg->msg.memory.regions[idx].mmap_offset;
+            region->mmap_offset = msg->msg.memory.regions[idx].mmap_offset;
+            // the mapping is prefaulted, its pages already sit on their node
+            region->node = region->mmap_addr ?
+                    numa_node_of_addr((void*) (uintptr_t) region->mmap_addr) : -1;
+            region->mmap_addr += region->mmap_offset;
+            fprintf(stdout, "Region %d on node %d\n", idx, region->node);
 
             vhost_server->memory.nregions++;
         }
     }
 
+    _sort_guest_ranges(&vhost_server->memory);
+
     fprintf(stdout, "Got memory.nregions %d\n", vhost_server->memory.nregions);
 
     return 0;
@@ -198,21 +379,135 @@ static int _set_vring_num(VhostServer* vhost_server, ServerMsg* msg)
     fprintf(stdout, "%s\n", __FUNCTION__);
 
     int idx = msg->msg.state.index;
+    unsigned int num = msg->msg.state.num;
 
-    assert(idx<VHOST_CLIENT_VRING_NUM);
+    assert(idx < vhost_server->vring_table.num_vrings);
 
-    vhost_server->vring_table.vring[idx].num = msg->msg.state.num;
+    // split ring indexes wrap at 65536, its size has to be a power of 2
+    if (num == 0 || num > VHOST_VRING_SIZE
+            || (!VRING_HAS_FEATURE(&vhost_server->vring_table, VIRTIO_F_RING_PACKED)
+                && (num & (num - 1)))) {
+        fprintf(stderr, "Invalid vring %d size %u\n", idx, num);
+        return -1;
+    }
+
+    vhost_server->vring_table.vring[idx].num = num;
 
     return 0;
 }
 
+// addr所在region的node，不在任何region里返回-1
+static int _region_node(VhostServer* vhost_server, uintptr_t addr)
+{
+    int idx;
+
+    for (idx = 0; idx < vhost_server->memory.nregions; idx++) {
+        VhostServerMemoryRegion *region = &vhost_server->memory.regions[idx];
+        uintptr_t base = region->mmap_addr - region->mmap_offset;
+
+        if (region->mmap_addr && base <= addr && addr < base + region->memory_size) {
+            return region->node;
+        }
+    }
+
+    return -1;
+}
+
+// node上的mempool，没有时创建并绑定到node，失败时用公共的mempool
+static Mempool* _node_mempool(VhostServer* vhost_server, int node)
+{
+    Mempool* pool = vhost_server->node_mempools[node];
+
+    if (pool) {
+        return pool;
+    }
+
+    pool = new_mempool(VHOST_SERVER_MEMPOOL_SIZE, VHOST_SERVER_PKTBUF_SIZE);
+    if (!pool) {
+        return vhost_server->mempool;
+    }
+    if (numa_bind(pool->mem, (size_t) pool->num * pool->elt_size, node) != 0) {
+        perror("numa_bind mempool");
+    }
+    vhost_server->node_mempools[node] = pool;
+
+    return pool;
+}
+
+/* queue pair交给另一个worker，TX ring的kickfd也改由它watch
+ * 新的worker马上看一次，kick可能刚发给了原来的worker
+ */
+static int _move_queue(VhostServer* vhost_server, uint32_t qp, Worker* to)
+{
+    VhostServerQueue* queue = &vhost_server->queues[qp];
+    int kickfd = vhost_server->vring_table.vring[VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_TX)].kickfd;
+
+    if (move_worker_queue(queue->worker, to, qp) != 0) {
+        return -1;
+    }
+    if (kickfd >= 0) {
+        worker_unwatch_fd(queue->worker, kickfd);
+        worker_watch_fd(to, kickfd);
+    }
+    queue->worker = to;
+    wake_worker(to);
+
+    return 0;
+}
+
+/* TX ring在node上：queue pair的私有buffer和mempool都换到这个node，
+ * 并交给这个node上queue最少的worker。控制线程在queue pair停下时调用
+ */
+static void _place_queue(VhostServer* vhost_server, uint32_t qp, int node)
+{
+    VhostServerQueue* queue = &vhost_server->queues[qp];
+    Mempool* pool;
+    uint32_t idx, best = vhost_server->worker_num;
+
+    if (node < 0 || node >= NUMA_NODES_MAX || node == queue->node) {
+        return;
+    }
+    queue->node = node;
+    fprintf(stdout, "Queue pair %u on node %d\n", qp, node);
+
+    // on a single node everything is local already
+    if (vhost_server->numa_nodes < 2) {
+        return;
+    }
+
+    if (numa_bind(queue, sizeof(*queue), node) != 0) {
+        perror("numa_bind queue");
+    }
+
+    // packets held in rx_pending go back to their own pool when they are freed
+    pool = _node_mempool(vhost_server, node);
+    if (pool != queue->cache.pool) {
+        flush_mempool_cache(&queue->cache);
+        init_mempool_cache(&queue->cache, pool);
+    }
+
+    for (idx = 0; idx < vhost_server->worker_num; idx++) {
+        if (vhost_server->worker_nodes[idx] == node && (best == vhost_server->worker_num
+                || atomic_load(&vhost_server->workers[idx]->queue_num)
+                    < atomic_load(&vhost_server->workers[best]->queue_num))) {
+            best = idx;
+        }
+    }
+
+    if (best < vhost_server->worker_num && queue->worker
+            && queue->worker != vhost_server->workers[best]
+            && _move_queue(vhost_server, qp, vhost_server->workers[best]) == 0) {
+        fprintf(stdout, "Queue pair %u moved to worker %u\n", qp, best);
+    }
+}
+
 static int _set_vring_addr(VhostServer* vhost_server, ServerMsg* msg)
 {
     fprintf(stdout, "%s\n", __FUNCTION__);
 
     int idx = msg->msg.addr.index;
 
-    assert(idx<VHOST_CLIENT_VRING_NUM);
+    assert(idx < vhost_server->vring_table.num_vrings);
 
     vhost_server->vring_table.vring[idx].desc =
             (struct vring_desc*) _map_user_addr(vhost_server,
@@ -224,8 +519,25 @@ static int _set_vring_addr(VhostServer* vhost_server, ServerMsg* msg)
             (struct vring_used*) _map_user_addr(vhost_server,
                     msg->msg.addr.used_user_addr);
 
-    vhost_server->vring_table.vring[idx].last_used_idx =
-            vhost_server->vring_table.vring[idx].used->idx;
+    // the packed ring has no used->idx, its position comes with SET_VRING_BASE
+    if (!VRING_HAS_FEATURE(&vhost_server->vring_table, VIRTIO_F_RING_PACKED)) {
+        vhost_server->vring_table.vring[idx].last_used_idx =
+                vhost_server->vring_table.vring[idx].used->idx;
+    }
+
+    // a kick may have come before the ring was set up, look at the ring once
+    vhost_server->queues[VHOST_VRING_QP(idx)].tx_backlog = 1;
+
+    // the worker reads the TX ring and its buffers, it belongs on their node
+    if (VHOST_VRING_IS_TX(idx)) {
+        _place_queue(vhost_server, VHOST_VRING_QP(idx),
+                _region_node(vhost_server, (uintptr_t) vhost_server->vring_table.vring[idx].desc));
+    }
+
+    // the client needn't kick a ring that is busy-polled
+    if (VHOST_VRING_IS_TX(idx) && vhost_server->queues[VHOST_VRING_QP(idx)].polling) {
+        vring_set_notify(&vhost_server->vring_table, idx, 0);
+    }
 
     return 0;
 }
@@ -236,11 +548,9 @@ static int _set_vring_base(VhostServer* vhost_server, ServerMsg* msg)
 
     int idx = msg->msg.state.index;
 
-    assert(idx<VHOST_CLIENT_VRING_NUM);
-
-    vhost_server->vring_table.vring[idx].last_avail_idx = msg->msg.state.num;
+    assert(idx < vhost_server->vring_table.num_vrings);
 
-    return 0;
+    return set_vring_base(&vhost_server->vring_table, idx, msg->msg.state.num);
 }
 
 static int _get_vring_base(VhostServer* vhost_server, ServerMsg* msg)
@@ -249,78 +559,154 @@ static int _get_vring_base(VhostServer* vhost_server, ServerMsg* msg)
 
     int idx = msg->msg.state.index;
 
-    assert(idx<VHOST_CLIENT_VRING_NUM);
+    assert(idx < vhost_server->vring_table.num_vrings);
 
-    msg->msg.state.num = vhost_server->vring_table.vring[idx].last_avail_idx;
+    msg->msg.state.num = get_vring_base(&vhost_server->vring_table, idx);
     msg->msg.size = MEMBER_SIZE(VhostUserMsg,state);
 
     return 1; // should reply back
 }
 
-// vring的_process_desc调用avail_handler，对server端就是该函数
-// 它把收到的数据拷到私有的buffer空间，后面poll_server得到buffer_size非零会打出报文
-static int avail_handler_server(void* context, void* buf, size_t size)
+static uintptr_t map_handler(void* context, uint64_t addr)
 {
     VhostServer* vhost_server = (VhostServer*) context;
+    return _map_guest_addr(vhost_server, addr);
+}
 
-    // copy the packet to our private buffer
-    memcpy(vhost_server->buffer, buf, size);
-    vhost_server->buffer_size = size;
-
-#ifdef DUMP_PACKETS
-    dump_buffer(buf, size);
-#endif
+/* 一次翻译一个burst的地址，只在换region时查表
+ * 最后命中的一项在返回时写回last_hit
+ */
+static void map_burst_handler(void* context, const uint64_t addr[], uintptr_t result[],
+        uint32_t n)
+{
+    VhostServer* vhost_server = (VhostServer*) context;
+    VhostServerMemory* memory = &vhost_server->memory;
+    uint32_t hit = atomic_load_explicit(&memory->last_hit, memory_order_relaxed);
+    uint32_t first = hit;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        if (hit >= memory->nregions || addr[i] < memory->ranges[hit].start
+                || addr[i] >= memory->ranges[hit].end) {
+            uint32_t found = _find_guest_range(memory, addr[i]);
+
+            if (found == memory->nregions) {
+                result[i] = 0;
+                continue;
+            }
+            hit = found;
+        }
+        result[i] = addr[i] + memory->ranges[hit].offset;
+    }
 
-    return 0;
+    if (hit != first) {
+        atomic_store_explicit(&memory->last_hit, hit, memory_order_relaxed);
+    }
 }
 
-static uintptr_t map_handler(void* context, uint64_t addr)
+/* 自适应的轮询/中断，由处理这个queue pair的线程在每次取TX ring之后调用
+ * 流量持续时关掉kick，一直轮询；空闲够久了重新打开kick，等kick唤醒
+ */
+static void _adapt_queue(VhostServer* vhost_server, uint32_t qp, uint32_t count, int full)
 {
-    VhostServer* vhost_server = (VhostServer*) context;
-    return _map_guest_addr(vhost_server, addr);
+    VhostServerQueue* queue = &vhost_server->queues[qp];
+    int idx = VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_TX);
+    uint64_t now = _now_us();
+
+    if (count) {
+        queue->busy_streak = now - queue->last_busy < vhost_server->poll_idle_us ?
+                queue->busy_streak + 1 : 1;
+        queue->last_busy = now;
+        if (!queue->polling && (full || queue->busy_streak >= VHOST_SERVER_POLL_STREAK)) {
+            queue->polling = 1;
+            vring_set_notify(&vhost_server->vring_table, idx, 0);
+        }
+        return;
+    }
+
+    // without a kickfd nothing would wake the ring up
+    if (!queue->polling || queue->no_kick || now - queue->last_busy < vhost_server->poll_idle_us) {
+        return;
+    }
+
+    // packets that came in just before the kicks were back on get no kick of their own
+    if (vring_set_notify(&vhost_server->vring_table, idx, 1)) {
+        queue->last_busy = now;
+        return;
+    }
+    queue->polling = 0;
+    queue->busy_streak = 0;
 }
 
-static int _poll_avail_vring(VhostServer* vhost_server, int idx)
+/* 从TX ring取包，包不拷贝，desc在转发到RX ring之后才归还
+ * 后面poll_server得到tx_pkts_num非零会转发这些包
+ */
+static int _poll_avail_vring(VhostServer* vhost_server, uint32_t qp)
 {
+    VhostServerQueue* queue = &vhost_server->queues[qp];
+    int idx = VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_TX);
     uint32_t count = 0;
+    uint32_t room = VRING_BURST_MAX - queue->tx_pkts_num;
 
     // if vring is already set, process the vring
-    if (vhost_server->vring_table.vring[idx].desc) {
-        count = process_avail_vring(&vhost_server->vring_table, idx);
-#ifndef DUMP_PACKETS
-        update_stat(&vhost_server->stat, count);
-        print_stat(&vhost_server->stat);
-#endif
+    if (vhost_server->vring_table.vring[idx].desc && room) {
+        count = dequeue_burst(&vhost_server->vring_table, idx,
+                queue->tx_pkts + queue->tx_pkts_num, room);
+        queue->tx_pkts_num += count;
+
+        // a full burst means the ring is polled again right away
+        _adapt_queue(vhost_server, qp, count, count == room);
+        queue->tx_backlog = queue->polling;
+        // counted into stat by the control thread
+        atomic_fetch_add_explicit(&queue->processed, count, memory_order_relaxed);
     }
 
     return count;
 }
 
+/* 控制线程处理的queue pair，kick排进FdList的io_uring批量提交
+ * worker不能碰FdList，自己write
+ */
+static int kick_handler(void* context, uint32_t v_idx)
+{
+    VhostServer* vhost_server = (VhostServer*) context;
+
+    if (vhost_server->queues[VHOST_VRING_QP(v_idx)].worker) {
+        return -1;
+    }
+
+    return notify_fd_list(&vhost_server->unsock->fd_list,
+            vhost_server->vring_table.vring[v_idx].kickfd);
+}
+
 static int _kick_server(struct fd_node* node)
 {
     VhostServer* vhost_server = (VhostServer*) node->context;
+    VringTable* vring_table = &vhost_server->vring_table;
     int kickfd = node->fd;
-    ssize_t r;
-    uint64_t kick_it = 0;
-
-    r = read(kickfd, &kick_it, sizeof(kick_it));
+    uint32_t idx;
 
-    if (r < 0) {
-        perror("recv kick");
-    } else if (r == 0) {
-        fprintf(stdout, "Kick fd closed\n");
-        del_fd_list(&vhost_server->unsock->fd_list, FD_READ, kickfd);
-    } else {
+    // FD_EVENT: the FdList has read the counter
 #if 0
-        fprintf(stdout, "Got kick %"PRId64"\n", kick_it);
+    fprintf(stdout, "Got kick %"PRId64"\n", node->value);
 #endif
-        _poll_avail_vring(vhost_server, VHOST_CLIENT_VRING_IDX_TX);
+    // find the TX ring the kick belongs to
+    for (idx = VHOST_CLIENT_VRING_IDX_TX; idx < vring_table->num_vrings;
+            idx += VHOST_CLIENT_VRING_NUM) {
+        if (vring_table->vring[idx].kickfd == kickfd) {
+            // a worker polls the ring itself
+            if (vring_table->vring[idx].enabled
+                    && !vhost_server->queues[VHOST_VRING_QP(idx)].worker) {
+                _poll_avail_vring(vhost_server, VHOST_VRING_QP(idx));
+            }
+            break;
+        }
     }
 
     return 0;
 }
 
-// 在此决定使用中断还是轮询
+// 有kickfd时先用中断，流量持续后由_adapt_queue切到轮询
 // server (slave) 监听kick
 static int _set_vring_kick(VhostServer* vhost_server, ServerMsg* msg)
 {
@@ -328,8 +714,9 @@ static int _set_vring_kick(VhostServer* vhost_server, ServerMsg* msg)
 
     int idx = msg->msg.u64 & VHOST_USER_VRING_IDX_MASK;
     int validfd = (msg->msg.u64 & VHOST_USER_VRING_NOFD_MASK) == 0;
+    VhostServerQueue* queue = &vhost_server->queues[VHOST_VRING_QP(idx)];
 
-    assert(idx < VHOST_CLIENT_VRING_NUM);
+    assert(idx < vhost_server->vring_table.num_vrings);
     if (validfd) {
         assert(msg->fd_num == 1);
 
@@ -337,18 +724,32 @@ static int _set_vring_kick(VhostServer* vhost_server, ServerMsg* msg)
 
         fprintf(stdout, "Got kickfd 0x%x\n", vhost_server->vring_table.vring[idx].kickfd);
 
-        if (idx == VHOST_CLIENT_VRING_IDX_TX) {
-            add_fd_list(&vhost_server->unsock->fd_list, FD_READ,
-                    vhost_server->vring_table.vring[idx].kickfd,
-                    (void*) vhost_server, _kick_server);
+        // a worker sleeps on the kickfds of its queue pairs, the control thread in its FdList
+        if (VHOST_VRING_IS_TX(idx)) {
+            queue->no_kick = 0;
+            if (queue->worker) {
+                worker_watch_fd(queue->worker, vhost_server->vring_table.vring[idx].kickfd);
+            } else {
+                add_fd_list(&vhost_server->unsock->fd_list, FD_EVENT,
+                        vhost_server->vring_table.vring[idx].kickfd,
+                        (void*) vhost_server, _kick_server);
+            }
             fprintf(stdout, "Listening for kicks on 0x%x\n", vhost_server->vring_table.vring[idx].kickfd);
         }
-        vhost_server->is_polling = 0;
-    } else {
+    } else if (VHOST_VRING_IS_TX(idx)) {
         fprintf(stdout, "Got empty kickfd. Start polling.\n");
-        vhost_server->is_polling = 1;
+        queue->no_kick = 1;
+        queue->polling = 1;
+        if (vhost_server->vring_table.vring[idx].desc) {
+            vring_set_notify(&vhost_server->vring_table, idx, 0);
+        }
     }
-    LOG("%s: is_polling %d\n", __FUNCTION__, vhost_server->is_polling);
+
+    // without VHOST_USER_F_PROTOCOL_FEATURES the ring is enabled once it is kicked
+    if (!VRING_HAS_FEATURE(&vhost_server->vring_table, VHOST_USER_F_PROTOCOL_FEATURES)) {
+        vhost_server->vring_table.vring[idx].enabled = 1;
+    }
+    LOG("%s: polling %d\n", __FUNCTION__, queue->polling);
     return 0;
 }
 
@@ -367,7 +768,7 @@ static int _set_vring_call(VhostServer* vhost_server, ServerMsg* msg)
     int idx = msg->msg.u64 & VHOST_USER_VRING_IDX_MASK;
     int validfd = (msg->msg.u64 & VHOST_USER_VRING_NOFD_MASK) == 0;
 
-    assert(idx < VHOST_CLIENT_VRING_NUM);
+    assert(idx < vhost_server->vring_table.num_vrings);
     if (validfd) {
         assert(msg->fd_num == 1);
 
@@ -385,6 +786,29 @@ static int _set_vring_err(VhostServer* vhost_server, ServerMsg* msg)
     return 0;
 }
 
+/* VHOST_USER_SET_VRING_ENABLE (18) Master payload: vring state description
+   Enable (num 1) or disable (num 0) the ring, used once
+   VHOST_USER_F_PROTOCOL_FEATURES is negotiated. A queue pair is processed
+   only while both of its rings are enabled.
+*/
+static int _set_vring_enable(VhostServer* vhost_server, ServerMsg* msg)
+{
+    fprintf(stdout, "%s\n", __FUNCTION__);
+
+    int idx = msg->msg.state.index;
+
+    assert(idx < vhost_server->vring_table.num_vrings);
+
+    vhost_server->vring_table.vring[idx].enabled = msg->msg.state.num != 0;
+
+    // the client may have queued packets while the ring was off
+    if (VHOST_VRING_IS_TX(idx)) {
+        vhost_server->queues[VHOST_VRING_QP(idx)].tx_backlog = 1;
+    }
+
+    return 0;
+}
+
 // return value > 0 if reply is required. otherwise 0.
 // < 0 means error
 // TODO: move message handling to a separate module.
@@ -404,57 +828,425 @@ static MsgHandler msg_handlers[VHOST_USER_MAX] = {
     _set_vring_kick,    // VHOST_USER_SET_VRING_KICK
     _set_vring_call,    // VHOST_USER_SET_VRING_CALL
     _set_vring_err,     // VHOST_USER_SET_VRING_ERR
+    _get_protocol_features, // VHOST_USER_GET_PROTOCOL_FEATURES
+    _set_protocol_features, // VHOST_USER_SET_PROTOCOL_FEATURES
+    _get_queue_num,     // VHOST_USER_GET_QUEUE_NUM
+    _set_vring_enable,  // VHOST_USER_SET_VRING_ENABLE
 };
 
+// 两个ring都设置好并且enable之后才处理这个queue pair，由控制线程更新
+static void _update_queue_ready(VhostServer* vhost_server, uint32_t qp)
+{
+    Vring* rx = &vhost_server->vring_table.vring[VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_RX)];
+    Vring* tx = &vhost_server->vring_table.vring[VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_TX)];
+
+    int ready = rx->desc && tx->desc && rx->enabled && tx->enabled;
+
+    atomic_store_explicit(&vhost_server->queues[qp].ready, ready, memory_order_release);
+
+    // the worker may be asleep, it has to look at the rings once
+    if (ready && vhost_server->queues[qp].worker) {
+        wake_worker(vhost_server->queues[qp].worker);
+    }
+}
+
+static int _queue_ready(VhostServer* vhost_server, uint32_t qp)
+{
+    return atomic_load_explicit(&vhost_server->queues[qp].ready, memory_order_acquire);
+}
+
+// 让worker放下这个queue pair，返回后控制线程可以修改它的vring
+static void _stop_queue(VhostServer* vhost_server, uint32_t qp)
+{
+    VhostServerQueue* queue = &vhost_server->queues[qp];
+
+    if (_queue_ready(vhost_server, qp)) {
+        atomic_store(&queue->ready, 0);
+        if (queue->worker) {
+            sync_worker(queue->worker);
+        }
+    }
+}
+
+/* 消息涉及的queue pair：返回0不涉及，1为*qp，2为全部
+ * 修改vring或features、内存映射的消息处理期间，worker不能碰这些vring
+ */
+static int _msg_queues(VhostServer* vhost_server, ServerMsg* msg, uint32_t* qp)
+{
+    uint32_t idx;
+
+    switch (msg->msg.request) {
+    case VHOST_USER_SET_FEATURES:
+    case VHOST_USER_RESET_OWNER:
+    case VHOST_USER_SET_MEM_TABLE:
+        return 2;
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ENABLE:
+        idx = msg->msg.state.index;
+        break;
+    case VHOST_USER_SET_VRING_ADDR:
+        idx = msg->msg.addr.index;
+        break;
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR:
+        idx = msg->msg.u64 & VHOST_USER_VRING_IDX_MASK;
+        break;
+    default:
+        return 0;
+    }
+
+    if (idx >= vhost_server->vring_table.num_vrings) {
+        return 0;
+    }
+    *qp = VHOST_VRING_QP(idx);
+
+    return 1;
+}
+
 // vhost server回调，处理vhost消息，由receive_sock_server调用
 static int in_msg_server(void* context, ServerMsg* msg)
 {
     VhostServer* vhost_server = (VhostServer*) context;
     int result = 0;
+    uint32_t qp = 0, first = 0, last = 0;
 
     fprintf(stdout, "Processing message: %s\n", cmd_from_vhost_request(msg->msg.request));
 
     assert(msg->msg.request > VHOST_USER_NONE && msg->msg.request < VHOST_USER_MAX);
 
+    switch (_msg_queues(vhost_server, msg, &qp)) {
+    case 1:
+        first = qp;
+        last = qp + 1;
+        break;
+    case 2:
+        last = vhost_server->queue_pairs;
+        break;
+    }
+
+    for (qp = first; qp < last; qp++) {
+        _stop_queue(vhost_server, qp);
+    }
+
     // call dedicated message handler according to request value.
     if (msg_handlers[msg->msg.request]) {
         result = msg_handlers[msg->msg.request](vhost_server, msg);
     }
+
+    for (qp = first; qp < last; qp++) {
+        _update_queue_ready(vhost_server, qp);
+    }
     fprintf(stdout, "Processing message: %s Done, result %d\n", cmd_from_vhost_request(msg->msg.request), result);
 
     return result;
 }
 
+/* 先放rx_pending里排队的包，保持包的顺序
+ * 返回1表示都放完了，RX ring又满了返回0
+ */
+static int _put_rx_pending(VhostServer* vhost_server, VhostServerQueue* queue, int rx_idx)
+{
+    VringPacket pkts[VRING_BURST_MAX];
+
+    while (queue->rx_pending_num) {
+        uint32_t n = MIN(queue->rx_pending_num, VRING_BURST_MAX);
+        uint32_t i, put;
+
+        for (i = 0; i < n; i++) {
+            pktbuf_to_packet(queue->rx_pending[(queue->rx_pending_head + i)
+                    % VHOST_SERVER_RX_PENDING_MAX], &pkts[i]);
+        }
+
+        put = put_vring_burst(&vhost_server->vring_table, rx_idx, pkts, n);
+
+        for (i = 0; i < put; i++) {
+            free_pktbuf(&queue->cache, queue->rx_pending[queue->rx_pending_head]);
+            queue->rx_pending_head = (queue->rx_pending_head + 1) % VHOST_SERVER_RX_PENDING_MAX;
+        }
+        queue->rx_pending_num -= put;
+
+        if (put < n) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* 放入RX ring，放不下的包，或前面还有包在排队时，拷到mempool排队
+ * 这样TX ring的desc总能马上归还，只有rx_pending满了或mempool用完才丢包
+ */
+static void _put_rx(VhostServer* vhost_server, VhostServerQueue* queue, int rx_idx,
+        VringPacket pkts[], uint32_t count)
+{
+    uint32_t i = 0;
+
+    if (_put_rx_pending(vhost_server, queue, rx_idx)) {
+        i = put_vring_burst(&vhost_server->vring_table, rx_idx, pkts, count);
+    }
+
+    for (; i < count && queue->rx_pending_num < VHOST_SERVER_RX_PENDING_MAX; i++) {
+        PktBuf* buf = new_pktbuf(&queue->cache, &pkts[i]);
+
+        if (!buf) {
+            break;
+        }
+        queue->rx_pending[(queue->rx_pending_head + queue->rx_pending_num)
+                % VHOST_SERVER_RX_PENDING_MAX] = buf;
+        queue->rx_pending_num++;
+    }
+}
+
+/* 把tx_pkts放入RX ring，能原样转发的包一段一段地放
+ * 客户端不接受的offload (没协商GUEST_CSUM/GUEST_TSO) 在软件里做完再放，做不了的包丢弃
+ * 坏的链由dequeue_burst作为空包交出，不转发，只归还它的TX desc
+ */
+static void _put_rx_burst(VhostServer* vhost_server, VhostServerQueue* queue, int rx_idx)
+{
+    VringTable* vring_table = &vhost_server->vring_table;
+    uint32_t start = 0;
+    uint32_t i;
+    int n;
+
+    for (i = 0; i < queue->tx_pkts_num; i++) {
+        int empty = !queue->tx_pkts[i].size;
+
+        if (!empty && !need_sw_offload(vring_table->features, &queue->tx_pkts[i])) {
+            continue;
+        }
+
+        _put_rx(vhost_server, queue, rx_idx, queue->tx_pkts + start, i - start);
+        start = i + 1;
+
+        if (empty) {
+            continue;
+        }
+
+        n = sw_offload(&queue->offload, &queue->tx_pkts[i]);
+        if (n > 0) {
+            _put_rx(vhost_server, queue, rx_idx, queue->offload.pkts, n);
+        }
+    }
+
+    _put_rx(vhost_server, queue, rx_idx, queue->tx_pkts + start, i - start);
+}
+
+// 一个queue pair：从TX ring取包，转发到同一queue pair的RX ring
+static void _poll_queue_pair(VhostServer* vhost_server, uint32_t qp)
+{
+    VhostServerQueue* queue = &vhost_server->queues[qp];
+    int tx_idx = VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_TX);
+    int rx_idx = VHOST_VRING_IDX(qp, VHOST_CLIENT_VRING_IDX_RX);
+
+    // process TX ring, a worker looks at it on every round it isn't asleep
+    if (queue->worker || queue->polling || queue->tx_backlog) {
+        _poll_avail_vring(vhost_server, qp);
+    }
+
+    // process RX ring
+    if (queue->tx_pkts_num) {
+        LOG("%s: queue %u tx_pkts_num %d\n", __FUNCTION__, qp, queue->tx_pkts_num);
+        // send the packets held from the TX ring
+        /* 注意：server端发送数据时，将数据放在rx ring，而client端是放在tx ring
+           可见，tx/rx是针对client，也即master端来说的。
+         */
+#ifdef DUMP_PACKETS
+        uint32_t i, j;
+        for (i = 0; i < queue->tx_pkts_num; i++) {
+            VringPacket* pkt = &queue->tx_pkts[i];
+            for (j = 0; j < pkt->iov_cnt; j++) {
+                dump_buffer(pkt->iov[j].iov_base, pkt->iov[j].iov_len);
+            }
+        }
+#endif
+        // take back the RX buffers the client has consumed
+        process_used_vring(&vhost_server->vring_table, rx_idx);
+
+        // the packets not fitting in the RX ring are held in rx_pending
+        _put_rx_burst(vhost_server, queue, rx_idx);
+
+        // the TX descriptors can go back to the client now
+        release_burst(&vhost_server->vring_table, tx_idx,
+                      queue->tx_pkts, queue->tx_pkts_num);
+
+        // signal the client, once for the whole burst
+        kick(&vhost_server->vring_table, rx_idx);
+
+        // mark the packets forwarded
+        queue->tx_pkts_num = 0;
+    } else if (queue->rx_pending_num) {
+        // no new packets, retry the held ones
+        uint32_t held = queue->rx_pending_num;
+
+        process_used_vring(&vhost_server->vring_table, rx_idx);
+        _put_rx_pending(vhost_server, queue, rx_idx);
+        if (queue->rx_pending_num < held) {
+            kick(&vhost_server->vring_table, rx_idx);
+        }
+    }
+}
+
+// worker线程的回调，轮询分配给它的一个queue pair
+static int _poll_worker(void* context, uint32_t qp)
+{
+    VhostServer* vhost_server = (VhostServer*) context;
+    VhostServerQueue* queue = &vhost_server->queues[qp];
+    uint64_t processed = atomic_load_explicit(&queue->processed, memory_order_relaxed);
+    uint64_t start;
+    int count;
+
+    if (!_queue_ready(vhost_server, qp)) {
+        return WORKER_IDLE;
+    }
+
+    start = worker_cycles();
+    _poll_queue_pair(vhost_server, qp);
+
+    // empty polls are the worker idling, only the ones with packets count as load
+    count = atomic_load_explicit(&queue->processed, memory_order_relaxed) - processed;
+    if (count) {
+        atomic_fetch_add_explicit(&queue->busy, worker_cycles() - start, memory_order_relaxed);
+    }
+
+    // with the kicks back on the worker may sleep until one comes
+    return (count || queue->polling) ? count : WORKER_IDLE;
+}
+
+// worker不绑定CPU，或者queue pair的node未知时，都不算跨node
+static int _worker_near(VhostServer* vhost_server, uint32_t worker, uint32_t qp)
+{
+    int node = vhost_server->queues[qp].node;
+
+    return node < 0 || vhost_server->worker_nodes[worker] < 0
+            || vhost_server->worker_nodes[worker] == node;
+}
+
+/* 按上个周期各queue pair的busy cycles估计每个worker的负载，
+ * 从最忙的worker移一个queue pair到最闲的worker，每次只移一个
+ * 选的queue pair移过去后差值最小，且至少小1/4；差值变化不大的移动只会互换忙闲
+ * 移过的queue pair之后VHOST_SERVER_REBALANCE_HOLD个周期不动，免得来回振荡
+ */
+static void _rebalance_workers(VhostServer* vhost_server)
+{
+    uint64_t load[VHOST_SERVER_WORKERS_MAX] = { 0 };
+    uint32_t queues[VHOST_SERVER_WORKERS_MAX] = { 0 };
+    uint64_t busy[VHOST_SERVER_QUEUE_PAIRS_MAX];
+    uint32_t qp, idx, max = 0, min = 0;
+    uint32_t best = vhost_server->queue_pairs;
+    uint64_t diff, gap, best_gap = 0;
+
+    for (qp = 0; qp < vhost_server->queue_pairs; qp++) {
+        VhostServerQueue* queue = &vhost_server->queues[qp];
+        uint64_t now = atomic_load_explicit(&queue->busy, memory_order_relaxed);
+
+        busy[qp] = now - queue->busy_last;
+        queue->busy_last = now;
+        if (queue->rebalance_hold) {
+            queue->rebalance_hold--;
+        }
+
+        for (idx = 0; queue->worker && idx < vhost_server->worker_num; idx++) {
+            if (vhost_server->workers[idx] == queue->worker) {
+                load[idx] += busy[qp];
+                queues[idx] += busy[qp] != 0;
+            }
+        }
+    }
+
+    for (idx = 1; idx < vhost_server->worker_num; idx++) {
+        if (load[idx] > load[max]) {
+            max = idx;
+        }
+        if (load[idx] < load[min]) {
+            min = idx;
+        }
+    }
+
+    // moving the only busy queue pair of a worker just moves the hot spot
+    diff = load[max] - load[min];
+    if (queues[max] < 2 || diff * VHOST_SERVER_REBALANCE_SKEW < load[max]) {
+        return;
+    }
+
+    for (qp = 0; qp < vhost_server->queue_pairs; qp++) {
+        // the gap between the two workers once the pair has moved
+        gap = llabs((int64_t) (diff - 2 * busy[qp]));
+
+        // a queue pair doesn't leave the node of its rings
+        if (vhost_server->queues[qp].worker != vhost_server->workers[max]
+                || !busy[qp] || vhost_server->queues[qp].rebalance_hold
+                || 4 * gap > 3 * diff || !_worker_near(vhost_server, min, qp)) {
+            continue;
+        }
+        if (best == vhost_server->queue_pairs || gap < best_gap) {
+            best = qp;
+            best_gap = gap;
+        }
+    }
+
+    if (best < vhost_server->queue_pairs
+            && _move_queue(vhost_server, best, vhost_server->workers[min]) == 0) {
+        vhost_server->queues[best].rebalance_hold = VHOST_SERVER_REBALANCE_HOLD;
+        fprintf(stdout, "Queue pair %u moved from worker %u to worker %u\n", best, max, min);
+    }
+}
+
+// 控制线程汇总各queue pair处理的包数
+static void _update_stat(VhostServer* vhost_server)
+{
+    uint64_t count = 0;
+    uint32_t qp;
+
+    for (qp = 0; qp < vhost_server->queue_pairs; qp++) {
+        VhostServerQueue* queue = &vhost_server->queues[qp];
+        uint64_t processed = atomic_load_explicit(&queue->processed, memory_order_relaxed);
+
+        count += processed - queue->reported;
+        queue->reported = processed;
+    }
+
+    if (count) {
+        update_stat(&vhost_server->stat, count);
+    }
+#ifndef DUMP_PACKETS
+    print_stat(&vhost_server->stat);
+#endif
+}
+
 static int poll_server(void* context)
 {
     VhostServer* vhost_server = (VhostServer*) context;
-    int tx_idx = VHOST_CLIENT_VRING_IDX_TX;
-    int rx_idx = VHOST_CLIENT_VRING_IDX_RX;
-
-    if (vhost_server->vring_table.vring[rx_idx].desc) {
-        // process TX ring
-        if (vhost_server->is_polling) {
-            _poll_avail_vring(vhost_server, tx_idx);
-        }
-
-        // process RX ring
-        if (vhost_server->buffer_size) {
-            LOG("%s: buffer_size %d\n", __FUNCTION__, vhost_server->buffer_size);
-            // send a packet from the buffer
-            /* 注意：server端发送数据时，将数据放在rx ring，而client端是放在tx ring
-               可见，tx/rx是针对client，也即master端来说的。
-             */
-            put_vring(&vhost_server->vring_table, rx_idx,
-                      vhost_server->buffer, vhost_server->buffer_size);
-
-            // signal the client
-            kick(&vhost_server->vring_table, rx_idx);
+    int backlog = 0;
+    uint32_t qp;
+
+    // with workers the control thread only handles vhost messages
+    for (qp = 0; qp < vhost_server->queue_pairs && !vhost_server->worker_num; qp++) {
+        if (_queue_ready(vhost_server, qp)) {
+            _poll_queue_pair(vhost_server, qp);
+            backlog |= vhost_server->queues[qp].tx_backlog;
+        }
+    }
+
+    _update_stat(vhost_server);
 
-            // mark the buffer empty
-            vhost_server->buffer_size = 0;
+    if (vhost_server->worker_num > 1) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - vhost_server->rebalanced.tv_sec) * 1000
+                + (now.tv_nsec - vhost_server->rebalanced.tv_nsec) / 1000000 >= VHOST_SERVER_REBALANCE_MS) {
+            _rebalance_workers(vhost_server);
+            vhost_server->rebalanced = now;
         }
     }
 
+    /* don't sleep in select while a TX ring has a backlog. the RX packets held
+     * wait for the next TX kick or select timeout, the client must make room first
+     */
+    vhost_server->unsock->fd_list.ms = backlog ? FD_LIST_SELECT_POLL : FD_LIST_SELECT_5;
     return 0;
 }
 
@@ -479,6 +1271,24 @@ int run_vhost_server(VhostServer* vhost_server)
 
     start_stat(&vhost_server->stat);
 
+    // queue pairs go round-robin to the workers, which start polling before any ring is ready
+    if (vhost_server->worker_num) {
+        uint32_t qp, idx;
+
+        for (qp = 0; qp < vhost_server->queue_pairs; qp++) {
+            Worker* worker = vhost_server->workers[qp % vhost_server->worker_num];
+
+            if (add_worker_queue(worker, qp) == 0) {
+                vhost_server->queues[qp].worker = worker;
+            }
+        }
+        for (idx = 0; idx < vhost_server->worker_num; idx++) {
+            if (start_worker(vhost_server->workers[idx]) != 0) {
+                return -1;
+            }
+        }
+    }
+
     app_running = 1; // externally modified
     while (app_running) {
         loop_server(vhost_server->unsock);
@@ -505,10 +1315,30 @@ int main(int argc, char* argv[])
     atexit(cleanup);
     init_signals();
 
-    char *path = argc == 2 ? argv[1] : NULL;
+    char *path = argc >= 2 ? argv[1] : NULL;
 
     /* vhost-user backend, who creates the unit domain socket */
     vhost_slave = new_vhost_server(path, 1);
+    if (!vhost_slave) {
+        return EXIT_FAILURE;
+    }
+
+    // optional comma separated CPUs, one poll-mode worker pinned to each (-1 not pinned)
+    if (argc >= 3) {
+        char* cpus = argv[2];
+
+        while (*cpus) {
+            char* end;
+            long cpu = strtol(cpus, &end, 0);
+
+            if (end == cpus || add_vhost_server_worker(vhost_slave, cpu) != 0) {
+                fprintf(stderr, "Invalid worker cpu list %s\n", argv[2]);
+                break;
+            }
+            cpus = *end == ',' ? end + 1 : end;
+        }
+    }
+
     run_vhost_server(vhost_slave);
     end_vhost_server(vhost_slave);
     free(vhost_slave);